@@ -0,0 +1,367 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "hashmap.h"
+
+/* every entry holds a file descriptor, so do not cache arbitrarily many small blobs */
+#define CACHE_MAX_ENTRIES (256)
+
+typedef struct CacheEntry CacheEntry;
+
+struct CacheEntry {
+        CacheEntry *prev;
+        CacheEntry *next;
+        char *name;
+        unsigned int dir;
+        FirmwareFormat format;
+        int fd;
+        dev_t dev;
+        ino_t ino;
+        struct timespec mtime;
+        off_t size;
+        /* size of the decompressed image if fd is a memfd rather than the firmware itself */
+        uint64_t memory;
+};
+
+struct Cache {
+        pthread_mutex_t lock;
+        Hashmap *entries;
+        /* most recently used first */
+        CacheEntry *head;
+        CacheEntry *tail;
+        uint64_t size;
+        uint64_t max_size;
+        uint64_t memory;
+        uint64_t max_memory;
+        uint64_t n_hits;
+        uint64_t n_image_hits;
+        uint64_t n_misses;
+        uint64_t n_evictions;
+        /* bumped by every removal, so that a lookup racing with one does not add what was removed */
+        uint64_t generation;
+};
+
+static bool cache_entry_matches(const CacheEntry *entry, const struct stat *st) {
+        return entry->dev == st->st_dev &&
+               entry->ino == st->st_ino &&
+               entry->size == st->st_size &&
+               entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+               entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static bool cache_entry_identical(const CacheEntry *a, const CacheEntry *b) {
+        return a->dev == b->dev &&
+               a->ino == b->ino &&
+               a->size == b->size &&
+               a->mtime.tv_sec == b->mtime.tv_sec &&
+               a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+static void cache_entry_free(CacheEntry *entry) {
+        if (entry->fd >= 0)
+                close(entry->fd);
+        free(entry);
+}
+
+static void cache_unlink(Cache *cache, CacheEntry *entry) {
+        if (entry->prev)
+                entry->prev->next = entry->next;
+        else
+                cache->head = entry->next;
+        if (entry->next)
+                entry->next->prev = entry->prev;
+        else
+                cache->tail = entry->prev;
+
+        entry->prev = entry->next = NULL;
+}
+
+static void cache_link_head(Cache *cache, CacheEntry *entry) {
+        entry->prev = NULL;
+        entry->next = cache->head;
+        if (cache->head)
+                cache->head->prev = entry;
+        else
+                cache->tail = entry;
+        cache->head = entry;
+}
+
+static void cache_drop(Cache *cache, CacheEntry *entry) {
+        cache_unlink(cache, entry);
+        hashmap_remove(cache->entries, entry->name);
+        if (entry->memory > 0)
+                cache->memory -= entry->memory;
+        else
+                cache->size -= entry->size;
+        cache_entry_free(entry);
+}
+
+/* drop least recently used entries until we are within budget, but never @keep */
+static void cache_evict(Cache *cache, CacheEntry *keep) {
+        CacheEntry *entry = cache->tail;
+
+        while (entry) {
+                CacheEntry *prev = entry->prev;
+
+                if (entry != keep &&
+                    (hashmap_size(cache->entries) > CACHE_MAX_ENTRIES ||
+                     (entry->memory > 0 && cache->memory > cache->max_memory) ||
+                     (entry->memory == 0 && cache->size > cache->max_size))) {
+                        cache_drop(cache, entry);
+                        cache->n_evictions ++;
+                }
+
+                if (hashmap_size(cache->entries) <= CACHE_MAX_ENTRIES &&
+                    cache->memory <= cache->max_memory &&
+                    cache->size <= cache->max_size)
+                        break;
+
+                entry = prev;
+        }
+}
+
+int cache_new(Cache **cachep, uint64_t max_size, uint64_t max_memory) {
+        Cache *cache;
+        int r;
+
+        cache = calloc(1, sizeof(*cache));
+        if (!cache)
+                return -ENOMEM;
+
+        r = hashmap_new(&cache->entries);
+        if (r < 0) {
+                free(cache);
+                return r;
+        }
+
+        r = pthread_mutex_init(&cache->lock, NULL);
+        if (r > 0) {
+                hashmap_free(cache->entries);
+                free(cache);
+                return -r;
+        }
+
+        cache->max_size = max_size;
+        cache->max_memory = max_memory;
+
+        *cachep = cache;
+
+        return 0;
+}
+
+void cache_free(Cache *cache) {
+        while (cache->head)
+                cache_drop(cache, cache->head);
+
+        hashmap_free(cache->entries);
+        pthread_mutex_destroy(&cache->lock);
+        free(cache);
+}
+
+/*
+ * Returns a new file descriptor for the cached firmware, or -ENOENT if it is
+ * not cached or the cached copy is no longer what is found in its search
+ * directory. For a cached decompressed image the descriptor refers to the
+ * image and the format is reported as raw.
+ */
+int cache_lookup(Cache *cache, const int *dirfds, const char *name, FirmwareFormat *formatp) {
+        CacheEntry *entry, identity;
+        char path[PATH_MAX];
+        struct stat st;
+        int fd, r;
+
+        pthread_mutex_lock(&cache->lock);
+
+        entry = hashmap_get(cache->entries, name);
+        if (!entry) {
+                cache->n_misses ++;
+                pthread_mutex_unlock(&cache->lock);
+                return -ENOENT;
+        }
+
+        fd = fcntl(entry->fd, F_DUPFD_CLOEXEC, 3);
+        identity = *entry;
+
+        cache_unlink(cache, entry);
+        cache_link_head(cache, entry);
+
+        pthread_mutex_unlock(&cache->lock);
+
+        if (fd < 0)
+                return -errno;
+
+        r = snprintf(path, sizeof(path), "%s%s", name, firmware_format_suffix(identity.format));
+        if (r >= 0 && (size_t) r < sizeof(path) &&
+            fstatat(dirfds[identity.dir], path, &st, 0) >= 0 &&
+            cache_entry_matches(&identity, &st)) {
+                pthread_mutex_lock(&cache->lock);
+                cache->n_hits ++;
+                if (identity.memory > 0)
+                        cache->n_image_hits ++;
+                pthread_mutex_unlock(&cache->lock);
+                *formatp = identity.memory > 0 ? FIRMWARE_FORMAT_RAW : identity.format;
+                return fd;
+        }
+
+        close(fd);
+
+        pthread_mutex_lock(&cache->lock);
+        cache->n_misses ++;
+        entry = hashmap_get(cache->entries, name);
+        if (entry && cache_entry_identical(entry, &identity))
+                cache_drop(cache, entry);
+        pthread_mutex_unlock(&cache->lock);
+
+        return -ENOENT;
+}
+
+uint64_t cache_get_generation(Cache *cache) {
+        uint64_t generation;
+
+        pthread_mutex_lock(&cache->lock);
+        generation = cache->generation;
+        pthread_mutex_unlock(&cache->lock);
+
+        return generation;
+}
+
+/*
+ * Caches the firmware @fd found in search directory @dir. If @memfd is valid it
+ * holds the decompressed image of @fd, and is what later lookups return.
+ */
+int cache_add(Cache *cache, const char *name, unsigned int dir, FirmwareFormat format, int fd, int memfd,
+              uint64_t generation) {
+        CacheEntry *entry;
+        struct stat st, memfd_st;
+        size_t name_len;
+        int r;
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+
+        if (memfd >= 0) {
+                if (fstat(memfd, &memfd_st) < 0)
+                        return -errno;
+
+                if ((uint64_t) memfd_st.st_size > cache->max_memory || memfd_st.st_size == 0)
+                        return 0;
+        } else if ((uint64_t) st.st_size > cache->max_size)
+                return 0;
+
+        name_len = strlen(name) + 1;
+        entry = calloc(1, sizeof(*entry) + name_len);
+        if (!entry)
+                return -ENOMEM;
+
+        entry->name = (char*)(entry + 1);
+        memcpy(entry->name, name, name_len);
+        entry->dir = dir;
+        entry->format = format;
+        entry->dev = st.st_dev;
+        entry->ino = st.st_ino;
+        entry->mtime = st.st_mtim;
+        entry->size = st.st_size;
+        entry->memory = memfd >= 0 ? (uint64_t) memfd_st.st_size : 0;
+
+        entry->fd = fcntl(memfd >= 0 ? memfd : fd, F_DUPFD_CLOEXEC, 3);
+        if (entry->fd < 0) {
+                r = -errno;
+                free(entry);
+                return r;
+        }
+
+        pthread_mutex_lock(&cache->lock);
+
+        /* raced with another worker resolving the same firmware, or with a removal */
+        if (generation != cache->generation || hashmap_get(cache->entries, name)) {
+                pthread_mutex_unlock(&cache->lock);
+                cache_entry_free(entry);
+                return 0;
+        }
+
+        r = hashmap_put(cache->entries, entry->name, entry);
+        if (r < 0) {
+                pthread_mutex_unlock(&cache->lock);
+                cache_entry_free(entry);
+                return r;
+        }
+
+        cache_link_head(cache, entry);
+        if (entry->memory > 0)
+                cache->memory += entry->memory;
+        else
+                cache->size += entry->size;
+
+        cache_evict(cache, entry);
+
+        pthread_mutex_unlock(&cache->lock);
+
+        return 0;
+}
+
+void cache_remove(Cache *cache, const char *name) {
+        CacheEntry *entry;
+
+        pthread_mutex_lock(&cache->lock);
+
+        cache->generation ++;
+        entry = hashmap_get(cache->entries, name);
+        if (entry)
+                cache_drop(cache, entry);
+
+        pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_remove_dirs(Cache *cache, unsigned int dir) {
+        CacheEntry *entry, *next;
+
+        pthread_mutex_lock(&cache->lock);
+
+        cache->generation ++;
+        for (entry = cache->head; entry; entry = next) {
+                next = entry->next;
+                if (entry->dir >= dir)
+                        cache_drop(cache, entry);
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+}
+
+/* moves entries of search directory i to map[i], and drops those where that is negative */
+void cache_renumber_dirs(Cache *cache, const int *map, unsigned int n_dirs) {
+        CacheEntry *entry, *next;
+
+        pthread_mutex_lock(&cache->lock);
+
+        for (entry = cache->head; entry; entry = next) {
+                next = entry->next;
+                if (entry->dir >= n_dirs || map[entry->dir] < 0)
+                        cache_drop(cache, entry);
+                else
+                        entry->dir = map[entry->dir];
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_get_stats(Cache *cache, CacheStats *stats) {
+        pthread_mutex_lock(&cache->lock);
+
+        stats->n_hits = cache->n_hits;
+        stats->n_image_hits = cache->n_image_hits;
+        stats->n_misses = cache->n_misses;
+        stats->n_evictions = cache->n_evictions;
+        stats->size = cache->size;
+        stats->memory = cache->memory;
+        stats->n_entries = hashmap_size(cache->entries);
+
+        pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "firmware.h"
+
+/*
+ * An LRU cache of resolved firmware blobs. Entries keep the firmware open and
+ * remember which search directory it was found in, so repeated requests for
+ * the same firmware skip the lookup. An entry is only used as long as the
+ * file it was opened from is still in place, as identified by its inode and
+ * modification time. A copy of the firmware that appears later in a search
+ * directory of higher precedence is not noticed until the entry goes stale, is
+ * evicted or is removed by the caller.
+ *
+ * Compressed firmware may be cached as its decompressed image in a sealed
+ * memfd instead, which is charged against a separate memory budget.
+ */
+
+typedef struct Cache Cache;
+
+typedef struct CacheStats {
+        uint64_t n_hits;
+        uint64_t n_image_hits;
+        uint64_t n_misses;
+        uint64_t n_evictions;
+        uint64_t size;
+        uint64_t memory;
+        unsigned int n_entries;
+} CacheStats;
+
+int cache_new(Cache **cachep, uint64_t max_size, uint64_t max_memory);
+void cache_free(Cache *cache);
+
+int cache_lookup(Cache *cache, const int *dirfds, const char *name, FirmwareFormat *formatp);
+/* a lookup takes the generation before it resolves @name, which is not added if it was removed meanwhile */
+uint64_t cache_get_generation(Cache *cache);
+int cache_add(Cache *cache, const char *name, unsigned int dir, FirmwareFormat format, int fd, int memfd,
+              uint64_t generation);
+void cache_remove(Cache *cache, const char *name);
+/* removes the entries found in search directory @dir, or in one of lower precedence */
+void cache_remove_dirs(Cache *cache, unsigned int dir);
+void cache_renumber_dirs(Cache *cache, const int *map, unsigned int n_dirs);
+
+void cache_get_stats(Cache *cache, CacheStats *stats);
+
+static inline void cache_freep(Cache **cachep) {
+        if (*cachep)
+                cache_free(*cachep);
+}
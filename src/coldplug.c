@@ -0,0 +1,122 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "coldplug.h"
+
+#define FIRMWARE_CLASS_PATH "/sys/class/firmware"
+
+struct linux_dirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+};
+
+/* returns 1 with the device's syspath and firmware name, or 0 if it is not a pending request */
+static int coldplug_read_device(int classfd, const char *entry, char *syspath, size_t syspath_size,
+                                char *name, size_t name_size) {
+        char target[PATH_MAX], buf[4096];
+        const char *relative, *value, *end;
+        ssize_t size;
+        int devicefd, fd, r;
+
+        devicefd = openat(classfd, entry, O_RDONLY|O_DIRECTORY|O_CLOEXEC|O_PATH);
+        if (devicefd < 0)
+                return errno == ENOENT || errno == ENOTDIR ? 0 : -errno;
+
+        fd = openat(devicefd, "uevent", O_RDONLY|O_CLOEXEC);
+        close(devicefd);
+        if (fd < 0)
+                return errno == ENOENT ? 0 : -errno;
+
+        size = read(fd, buf, sizeof(buf) - 1);
+        r = size < 0 ? -errno : 0;
+        close(fd);
+        if (r < 0)
+                return r == -ENODEV ? 0 : r;
+        buf[size] = '\0';
+
+        if (strncmp(buf, "FIRMWARE=", 9) == 0)
+                value = buf;
+        else {
+                value = strstr(buf, "\nFIRMWARE=");
+                if (!value)
+                        return 0;
+                value ++;
+        }
+
+        value += 9;
+        end = strchrnul(value, '\n');
+        if ((size_t) (end - value) >= name_size)
+                return 0;
+        memcpy(name, value, (size_t) (end - value));
+        name[end - value] = '\0';
+
+        /* class entries link to the device as ../../devices/... */
+        size = readlinkat(classfd, entry, target, sizeof(target) - 1);
+        if (size < 0)
+                return errno == ENOENT ? 0 : -errno;
+        target[size] = '\0';
+
+        relative = target;
+        while (strncmp(relative, "../", 3) == 0)
+                relative += 3;
+
+        r = snprintf(syspath, syspath_size, "/sys/%s", relative);
+        if (r < 0 || (size_t) r >= syspath_size)
+                return 0;
+
+        return 1;
+}
+
+int coldplug_scan(ColdplugCallback callback, void *userdata) {
+        char buf[4096] __attribute__((aligned(__alignof__(struct linux_dirent64))));
+        int classfd, n = 0, r = 0;
+
+        classfd = open(FIRMWARE_CLASS_PATH, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (classfd < 0)
+                return errno == ENOENT ? 0 : -errno;
+
+        while (r >= 0) {
+                long size;
+
+                size = syscall(SYS_getdents64, classfd, buf, sizeof(buf));
+                if (size < 0) {
+                        r = -errno;
+                        break;
+                }
+                if (size == 0)
+                        break;
+
+                for (long offset = 0; offset < size; ) {
+                        struct linux_dirent64 *de = (struct linux_dirent64*) (buf + offset);
+                        char syspath[PATH_MAX], name[PATH_MAX];
+
+                        offset += de->d_reclen;
+
+                        if (de->d_name[0] == '.' || strcmp(de->d_name, "timeout") == 0)
+                                continue;
+
+                        /* a device that cannot be read is skipped, it may just have gone away */
+                        if (coldplug_read_device(classfd, de->d_name, syspath, sizeof(syspath), name, sizeof(name)) <= 0)
+                                continue;
+
+                        r = callback(syspath, name, userdata);
+                        if (r < 0)
+                                break;
+
+                        n ++;
+                }
+        }
+
+        close(classfd);
+
+        return r < 0 ? r : n;
+}
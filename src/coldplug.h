@@ -0,0 +1,10 @@
+#pragma once
+
+/*
+ * Finds the firmware requests that are already waiting, by listing the
+ * devices in /sys/class/firmware and reading the name from their uevent file.
+ */
+
+typedef int (*ColdplugCallback)(const char *syspath, const char *name, void *userdata);
+
+int coldplug_scan(ColdplugCallback callback, void *userdata);
@@ -0,0 +1,79 @@
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+#include "firmware-backend.h"
+
+#define PREAD_BUFFER_SIZE (64 * 1024)
+
+static ssize_t sendfile_transfer(int datafd, int firmwarefd, off_t offset, size_t size) {
+        ssize_t n;
+
+        n = sendfile(datafd, firmwarefd, &offset, size);
+        if (n < 0)
+                return -errno;
+
+        return n;
+}
+
+const FirmwareBackend firmware_backend_sendfile = {
+        .name = "sendfile",
+        .transfer = sendfile_transfer,
+};
+
+static ssize_t mmap_transfer(int datafd, int firmwarefd, off_t offset, size_t size) {
+        long page_size = sysconf(_SC_PAGESIZE);
+        off_t map_offset;
+        size_t map_size;
+        void *map;
+        ssize_t n;
+
+        map_offset = offset & ~((off_t) page_size - 1);
+        map_size = size + (offset - map_offset);
+
+        map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, firmwarefd, map_offset);
+        if (map == MAP_FAILED)
+                return -errno;
+
+        n = write(datafd, (char*) map + (offset - map_offset), size);
+        if (n < 0)
+                n = -errno;
+
+        munmap(map, map_size);
+
+        return n;
+}
+
+const FirmwareBackend firmware_backend_mmap = {
+        .name = "mmap",
+        .transfer = mmap_transfer,
+};
+
+static ssize_t pread_transfer(int datafd, int firmwarefd, off_t offset, size_t size) {
+        static __thread char buffer[PREAD_BUFFER_SIZE];
+        ssize_t n, written;
+
+        n = pread(firmwarefd, buffer, size < sizeof(buffer) ? size : sizeof(buffer), offset);
+        if (n <= 0)
+                return n < 0 ? -errno : 0;
+
+        /* whatever is not written is simply read again by the next transfer */
+        written = write(datafd, buffer, n);
+        if (written < 0)
+                return -errno;
+
+        return written;
+}
+
+const FirmwareBackend firmware_backend_pread = {
+        .name = "pread",
+        .transfer = pread_transfer,
+};
+
+const FirmwareBackend * const firmware_backends[] = {
+        &firmware_backend_sendfile,
+        &firmware_backend_mmap,
+        &firmware_backend_pread,
+        NULL
+};
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Upload backends copy firmware into the sysfs data attribute. A transfer
+ * moves at most @size bytes from @offset of the firmware and returns the
+ * number of bytes written, which may be short, or a negative errno.
+ */
+
+typedef struct FirmwareBackend {
+        const char *name;
+        ssize_t (*transfer)(int datafd, int firmwarefd, off_t offset, size_t size);
+} FirmwareBackend;
+
+extern const FirmwareBackend firmware_backend_sendfile;
+extern const FirmwareBackend firmware_backend_mmap;
+extern const FirmwareBackend firmware_backend_pread;
+
+/* in order of preference */
+extern const FirmwareBackend * const firmware_backends[];
@@ -0,0 +1,202 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef HAVE_XZ
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "firmware-decompress.h"
+#include "log-util.h"
+
+/* the input and output buffers are bounded, the image is never decompressed as a whole */
+#define DECOMPRESS_BUFFER_SIZE (128 * 1024)
+
+#if defined(HAVE_XZ) || defined(HAVE_ZSTD)
+static ssize_t read_input(int firmwarefd, void *buf, off_t *offsetp) {
+        ssize_t n;
+
+        do
+                n = pread(firmwarefd, buf, DECOMPRESS_BUFFER_SIZE, *offsetp);
+        while (n < 0 && errno == EINTR);
+
+        if (n < 0)
+                return -errno;
+
+        *offsetp += n;
+
+        return n;
+}
+#endif
+
+#ifdef HAVE_XZ
+static int decompress_xz(int firmwarefd, void *in, void *out, FirmwareSink sink, void *userdata, uint64_t *sizep) {
+        lzma_stream stream = LZMA_STREAM_INIT;
+        lzma_action action = LZMA_RUN;
+        off_t offset = 0;
+        uint64_t size = 0;
+        lzma_ret ret;
+        int r;
+
+        ret = lzma_stream_decoder(&stream, UINT64_MAX, LZMA_CONCATENATED);
+        if (ret != LZMA_OK)
+                return ret == LZMA_MEM_ERROR ? -ENOMEM : -EINVAL;
+
+        stream.next_out = out;
+        stream.avail_out = DECOMPRESS_BUFFER_SIZE;
+
+        for (;;) {
+                if (stream.avail_in == 0 && action == LZMA_RUN) {
+                        ssize_t n;
+
+                        n = read_input(firmwarefd, in, &offset);
+                        if (n < 0) {
+                                r = n;
+                                goto finish;
+                        }
+
+                        stream.next_in = in;
+                        stream.avail_in = n;
+                        if (n == 0)
+                                action = LZMA_FINISH;
+                }
+
+                ret = lzma_code(&stream, action);
+
+                if (stream.avail_out == 0 || ret == LZMA_STREAM_END) {
+                        size_t len = DECOMPRESS_BUFFER_SIZE - stream.avail_out;
+
+                        if (len > 0) {
+                                r = sink(out, len, userdata);
+                                if (r < 0)
+                                        goto finish;
+                                size += len;
+                        }
+
+                        stream.next_out = out;
+                        stream.avail_out = DECOMPRESS_BUFFER_SIZE;
+                }
+
+                if (ret == LZMA_STREAM_END)
+                        break;
+
+                if (ret != LZMA_OK) {
+                        log_warn("corrupt xz firmware (error %u)", ret);
+                        r = ret == LZMA_MEM_ERROR ? -ENOMEM : -EBADMSG;
+                        goto finish;
+                }
+        }
+
+        *sizep = size;
+        r = 0;
+
+finish:
+        lzma_end(&stream);
+        return r;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int decompress_zstd(int firmwarefd, void *in, void *out, FirmwareSink sink, void *userdata, uint64_t *sizep) {
+        ZSTD_DStream *stream;
+        off_t offset = 0;
+        uint64_t size = 0;
+        size_t ret = 0;
+        int r;
+
+        stream = ZSTD_createDStream();
+        if (!stream)
+                return -ENOMEM;
+
+        ret = ZSTD_initDStream(stream);
+        if (ZSTD_isError(ret)) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        for (;;) {
+                ZSTD_inBuffer input = { .src = in };
+                ssize_t n;
+
+                n = read_input(firmwarefd, in, &offset);
+                if (n < 0) {
+                        r = n;
+                        goto finish;
+                } else if (n == 0)
+                        break;
+
+                input.size = n;
+
+                while (input.pos < input.size) {
+                        ZSTD_outBuffer output = {
+                                .dst = out,
+                                .size = DECOMPRESS_BUFFER_SIZE,
+                        };
+
+                        ret = ZSTD_decompressStream(stream, &output, &input);
+                        if (ZSTD_isError(ret)) {
+                                log_warn("corrupt zstd firmware: %s", ZSTD_getErrorName(ret));
+                                r = -EBADMSG;
+                                goto finish;
+                        }
+
+                        if (output.pos > 0) {
+                                r = sink(out, output.pos, userdata);
+                                if (r < 0)
+                                        goto finish;
+                                size += output.pos;
+                        }
+                }
+        }
+
+        /* a non-zero hint means the last frame is incomplete */
+        if (ret != 0) {
+                log_warn("truncated zstd firmware");
+                r = -EBADMSG;
+                goto finish;
+        }
+
+        *sizep = size;
+        r = 0;
+
+finish:
+        ZSTD_freeDStream(stream);
+        return r;
+}
+#endif
+
+int firmware_decompress(FirmwareFormat format, int firmwarefd, FirmwareSink sink, void *userdata, uint64_t *sizep) {
+        void *in, *out;
+        int r;
+
+        in = malloc(DECOMPRESS_BUFFER_SIZE);
+        out = malloc(DECOMPRESS_BUFFER_SIZE);
+        if (!in || !out) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        switch (format) {
+#ifdef HAVE_XZ
+        case FIRMWARE_FORMAT_XZ:
+                r = decompress_xz(firmwarefd, in, out, sink, userdata, sizep);
+                break;
+#endif
+#ifdef HAVE_ZSTD
+        case FIRMWARE_FORMAT_ZSTD:
+                r = decompress_zstd(firmwarefd, in, out, sink, userdata, sizep);
+                break;
+#endif
+        default:
+                r = -EOPNOTSUPP;
+                break;
+        }
+
+finish:
+        free(in);
+        free(out);
+        return r;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "firmware.h"
+
+/* receives each decompressed block; returns 0 or a negative errno to abort */
+typedef int (*FirmwareSink)(const void *buf, size_t size, void *userdata);
+
+int firmware_decompress(FirmwareFormat format, int firmwarefd, FirmwareSink sink, void *userdata, uint64_t *sizep);
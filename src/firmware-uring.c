@@ -0,0 +1,411 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "firmware-uring.h"
+#include "log-util.h"
+#include "time-util.h"
+
+#define RING_ENTRIES (64)
+
+/* an upload chain is two opens, two loading writes and two closes around the data writes */
+#define MAX_DATA_WRITES (RING_ENTRIES - 6)
+
+/* fixed file slots for the sysfs attributes of the device being loaded */
+#define SLOT_LOADING (0)
+#define SLOT_DATA    (1)
+
+typedef struct Ring {
+        int fd;
+        unsigned int sq_entries;
+        unsigned int *sq_khead;
+        unsigned int *sq_ktail;
+        unsigned int *sq_kmask;
+        unsigned int *sq_array;
+        unsigned int *cq_khead;
+        unsigned int *cq_ktail;
+        unsigned int *cq_kmask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        void *sq_ring;
+        size_t sq_ring_size;
+        void *cq_ring;
+        size_t cq_ring_size;
+        size_t sqes_size;
+        unsigned int sqe_tail;
+        unsigned int sqe_submitted;
+} Ring;
+
+static __thread Ring ring = { .fd = -1 };
+static __thread bool ring_unavailable;
+
+static void ring_release(void *p) {
+        if (ring.sqes)
+                munmap(ring.sqes, ring.sqes_size);
+        if (ring.cq_ring && ring.cq_ring != ring.sq_ring)
+                munmap(ring.cq_ring, ring.cq_ring_size);
+        if (ring.sq_ring)
+                munmap(ring.sq_ring, ring.sq_ring_size);
+        if (ring.fd >= 0)
+                close(ring.fd);
+
+        memset(&ring, 0, sizeof(ring));
+        ring.fd = -1;
+}
+
+static int ring_setup(void) {
+        struct io_uring_params params = {};
+        struct io_uring_rsrc_register files = {
+                .nr = 2,
+                .flags = IORING_RSRC_REGISTER_SPARSE,
+        };
+        int r;
+
+        ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+        if (ring.fd < 0)
+                return -errno;
+
+        ring.sq_entries = params.sq_entries;
+        ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ring.cq_ring_size > ring.sq_ring_size)
+                        ring.sq_ring_size = ring.cq_ring_size;
+                ring.cq_ring_size = ring.sq_ring_size;
+        }
+
+        ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                            ring.fd, IORING_OFF_SQ_RING);
+        if (ring.sq_ring == MAP_FAILED) {
+                ring.sq_ring = NULL;
+                r = -errno;
+                goto fail;
+        }
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+                ring.cq_ring = ring.sq_ring;
+        else {
+                ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                                    ring.fd, IORING_OFF_CQ_RING);
+                if (ring.cq_ring == MAP_FAILED) {
+                        ring.cq_ring = NULL;
+                        r = -errno;
+                        goto fail;
+                }
+        }
+
+        ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                         ring.fd, IORING_OFF_SQES);
+        if (ring.sqes == MAP_FAILED) {
+                ring.sqes = NULL;
+                r = -errno;
+                goto fail;
+        }
+
+        ring.sq_khead = (unsigned int*) ((char*) ring.sq_ring + params.sq_off.head);
+        ring.sq_ktail = (unsigned int*) ((char*) ring.sq_ring + params.sq_off.tail);
+        ring.sq_kmask = (unsigned int*) ((char*) ring.sq_ring + params.sq_off.ring_mask);
+        ring.sq_array = (unsigned int*) ((char*) ring.sq_ring + params.sq_off.array);
+        ring.cq_khead = (unsigned int*) ((char*) ring.cq_ring + params.cq_off.head);
+        ring.cq_ktail = (unsigned int*) ((char*) ring.cq_ring + params.cq_off.tail);
+        ring.cq_kmask = (unsigned int*) ((char*) ring.cq_ring + params.cq_off.ring_mask);
+        ring.cqes = (struct io_uring_cqe*) ((char*) ring.cq_ring + params.cq_off.cqes);
+        ring.sqe_tail = ring.sqe_submitted = *ring.sq_ktail;
+
+        /* direct descriptors let linked requests open a file and use it right away */
+        if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES2, &files, sizeof(files)) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        return 0;
+
+fail:
+        ring_release(NULL);
+        return r;
+}
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static void ring_key_setup(void) {
+        pthread_key_create(&ring_key, ring_release);
+}
+
+static bool ring_get(void) {
+        int r;
+
+        if (ring.fd >= 0)
+                return true;
+        if (ring_unavailable)
+                return false;
+
+        r = ring_setup();
+        if (r < 0) {
+                log_info("io_uring not available, using synchronous firmware loading: %s", strerror(-r));
+                ring_unavailable = true;
+                return false;
+        }
+
+        /* tear the ring down when the thread exits */
+        pthread_once(&ring_key_once, ring_key_setup);
+        pthread_setspecific(ring_key, &ring);
+
+        return true;
+}
+
+static struct io_uring_sqe *ring_get_sqe(void) {
+        struct io_uring_sqe *sqe;
+        unsigned int index;
+
+        if (ring.sqe_tail - __atomic_load_n(ring.sq_khead, __ATOMIC_ACQUIRE) >= ring.sq_entries)
+                return NULL;
+
+        index = ring.sqe_tail & *ring.sq_kmask;
+        sqe = &ring.sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        ring.sq_array[index] = index;
+        ring.sqe_tail ++;
+
+        return sqe;
+}
+
+static unsigned int ring_space(void) {
+        return ring.sq_entries - (ring.sqe_tail - __atomic_load_n(ring.sq_khead, __ATOMIC_ACQUIRE));
+}
+
+static int ring_enter(unsigned int wait_nr, unsigned int *n_syscallsp) {
+        unsigned int to_submit;
+        int r;
+
+        __atomic_store_n(ring.sq_ktail, ring.sqe_tail, __ATOMIC_RELEASE);
+        to_submit = ring.sqe_tail - ring.sqe_submitted;
+
+        do {
+                (*n_syscallsp) ++;
+                r = syscall(__NR_io_uring_enter, ring.fd, to_submit, wait_nr, IORING_ENTER_GETEVENTS, NULL, 0);
+        } while (r < 0 && errno == EINTR);
+
+        if (r < 0)
+                return -errno;
+
+        ring.sqe_submitted += r;
+
+        return 0;
+}
+
+/* submit everything queued and collect one result per request, indexed by user_data */
+static int ring_run(unsigned int n, int *results, unsigned int *n_syscallsp) {
+        unsigned int done = 0;
+        int r;
+
+        r = ring_enter(n, n_syscallsp);
+        if (r < 0)
+                return r;
+
+        while (done < n) {
+                unsigned int head = *ring.cq_khead;
+
+                if (head == __atomic_load_n(ring.cq_ktail, __ATOMIC_ACQUIRE)) {
+                        r = ring_enter(n - done, n_syscallsp);
+                        if (r < 0)
+                                return r;
+                        continue;
+                }
+
+                while (head != __atomic_load_n(ring.cq_ktail, __ATOMIC_ACQUIRE)) {
+                        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_kmask];
+
+                        if (cqe->user_data < n) {
+                                results[cqe->user_data] = cqe->res;
+                                done ++;
+                        }
+                        head ++;
+                }
+
+                __atomic_store_n(ring.cq_khead, head, __ATOMIC_RELEASE);
+        }
+
+        return 0;
+}
+
+static void prep_openat(struct io_uring_sqe *sqe, int dirfd, const char *path, int flags, int slot) {
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = dirfd;
+        sqe->addr = (uintptr_t) path;
+        sqe->open_flags = flags;
+        if (slot >= 0)
+                sqe->file_index = slot + 1;
+}
+
+static void prep_write_fixed(struct io_uring_sqe *sqe, int slot, const void *buf, size_t size, uint64_t offset) {
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fd = slot;
+        sqe->addr = (uintptr_t) buf;
+        sqe->len = size;
+        sqe->off = offset;
+}
+
+static void prep_close_fixed(struct io_uring_sqe *sqe, int slot) {
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = slot + 1;
+}
+
+/*
+ * Opens the first of @paths that exists, relative to the matching @dirfds,
+ * submitting all probes at once. Returns the fd and its index, or -ENOENT.
+ */
+int firmware_uring_open_first(unsigned int n, const int *dirfds, char * const *paths,
+                              unsigned int *indexp, unsigned int *n_syscallsp) {
+        int results[RING_ENTRIES];
+        int fd = -ENOENT;
+        int r;
+
+        if (!ring_get())
+                return -EOPNOTSUPP;
+
+        for (unsigned int start = 0; start < n && fd < 0; start += RING_ENTRIES) {
+                unsigned int batch = n - start < RING_ENTRIES ? n - start : RING_ENTRIES;
+
+                if (ring_space() < batch)
+                        return -EBUSY;
+
+                for (unsigned int i = 0; i < batch; i ++) {
+                        struct io_uring_sqe *sqe = ring_get_sqe();
+
+                        prep_openat(sqe, dirfds[start + i], paths[start + i], O_RDONLY|O_NONBLOCK|O_CLOEXEC, -1);
+                        sqe->user_data = i;
+                }
+
+                r = ring_run(batch, results, n_syscallsp);
+                if (r < 0)
+                        return r;
+
+                for (unsigned int i = 0; i < batch; i ++) {
+                        if (results[i] < 0)
+                                continue;
+
+                        /* only the first hit in search order counts */
+                        if (fd >= 0) {
+                                close(results[i]);
+                                (*n_syscallsp) ++;
+                                continue;
+                        }
+
+                        fd = results[i];
+                        *indexp = start + i;
+                }
+        }
+
+        return fd;
+}
+
+/*
+ * Uploads the whole firmware as one chain of linked requests: open loading
+ * and data into fixed slots, start the load, write the mapped firmware, finish
+ * the load and close both slots. If any step fails the rest of the chain is
+ * cancelled and the caller redoes the upload synchronously; writing 1 to
+ * loading again discards what was partially loaded.
+ */
+int firmware_uring_load(int devicefd, int firmwarefd, const struct stat *st, FirmwareStats *stats) {
+        static const char loading_start[] = "1\n", loading_finish[] = "0\n";
+        int results[RING_ENTRIES], expected[RING_ENTRIES];
+        unsigned int n = 0, n_syscalls = 0, n_writes;
+        uint64_t chunk, begin_usec;
+        void *map;
+        int r;
+
+        if (!ring_get())
+                return -EOPNOTSUPP;
+
+        if (st->st_size == 0)
+                return -EIO;
+
+        chunk = firmware_get_chunk_size();
+        if (((uint64_t) st->st_size + chunk - 1) / chunk > MAX_DATA_WRITES)
+                chunk = ((uint64_t) st->st_size + MAX_DATA_WRITES - 1) / MAX_DATA_WRITES;
+        n_writes = ((uint64_t) st->st_size + chunk - 1) / chunk;
+
+        if (ring_space() < n_writes + 6)
+                return -EBUSY;
+
+        map = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, firmwarefd, 0);
+        n_syscalls ++;
+        if (map == MAP_FAILED)
+                return -errno;
+
+        begin_usec = now_usec();
+
+        /* direct descriptors are never installed in the fd table, O_CLOEXEC is rejected for them */
+        prep_openat(ring_get_sqe(), devicefd, "loading", O_WRONLY, SLOT_LOADING);
+        expected[n++] = 0;
+        prep_openat(ring_get_sqe(), devicefd, "data", O_WRONLY, SLOT_DATA);
+        expected[n++] = 0;
+        /* loading is written at the current file position, like dprintf() does */
+        prep_write_fixed(ring_get_sqe(), SLOT_LOADING, loading_start, strlen(loading_start), UINT64_MAX);
+        expected[n++] = strlen(loading_start);
+        for (unsigned int i = 0; i < n_writes; i ++) {
+                uint64_t offset = (uint64_t) i * chunk;
+                size_t size = st->st_size - offset < chunk ? st->st_size - offset : chunk;
+
+                prep_write_fixed(ring_get_sqe(), SLOT_DATA, (char*) map + offset, size, offset);
+                expected[n++] = size;
+        }
+        prep_write_fixed(ring_get_sqe(), SLOT_LOADING, loading_finish, strlen(loading_finish), UINT64_MAX);
+        expected[n++] = strlen(loading_finish);
+        prep_close_fixed(ring_get_sqe(), SLOT_LOADING);
+        expected[n++] = 0;
+        prep_close_fixed(ring_get_sqe(), SLOT_DATA);
+        expected[n++] = 0;
+
+        for (unsigned int i = 0; i < n; i ++) {
+                struct io_uring_sqe *sqe = &ring.sqes[(ring.sqe_tail - n + i) & *ring.sq_kmask];
+
+                sqe->user_data = i;
+                if (i < n - 1)
+                        sqe->flags |= IOSQE_IO_LINK;
+        }
+
+        r = ring_run(n, results, &n_syscalls);
+        if (r >= 0)
+                for (unsigned int i = 0; i < n; i ++)
+                        if (results[i] != expected[i]) {
+                                /* a short write also severs the chain */
+                                r = results[i] < 0 ? results[i] : -EIO;
+                                break;
+                        }
+
+        munmap(map, st->st_size);
+        n_syscalls ++;
+
+        if (r < 0) {
+                /* make sure nothing is left open in the slots */
+                prep_close_fixed(ring_get_sqe(), SLOT_LOADING);
+                ring.sqes[(ring.sqe_tail - 1) & *ring.sq_kmask].user_data = 0;
+                prep_close_fixed(ring_get_sqe(), SLOT_DATA);
+                ring.sqes[(ring.sqe_tail - 1) & *ring.sq_kmask].user_data = 1;
+                ring_run(2, results, &n_syscalls);
+                return r;
+        }
+
+        if (stats) {
+                stats->size = st->st_size;
+                stats->usec = now_usec() - begin_usec;
+                stats->backend = "io_uring";
+                stats->n_syscalls = n_syscalls;
+                /* the chain completes as a whole, so the transfer takes it from start to finish */
+                stats->loading_usec = begin_usec;
+                stats->transferred_usec = stats->finished_usec = begin_usec + stats->usec;
+        }
+
+        return 0;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "firmware.h"
+
+/*
+ * io_uring variants of the firmware lookup and upload. They use a ring per
+ * thread, created on first use. Any failure, including the kernel not
+ * supporting io_uring, is reported as an error and the caller falls back to
+ * the synchronous implementation.
+ */
+
+#ifdef HAVE_IO_URING
+int firmware_uring_open_first(unsigned int n, const int *dirfds, char * const *paths,
+                              unsigned int *indexp, unsigned int *n_syscallsp);
+int firmware_uring_load(int devicefd, int firmwarefd, const struct stat *st, FirmwareStats *stats);
+#else
+static inline int firmware_uring_open_first(unsigned int n, const int *dirfds, char * const *paths,
+                                            unsigned int *indexp, unsigned int *n_syscallsp) {
+        return -EOPNOTSUPP;
+}
+
+static inline int firmware_uring_load(int devicefd, int firmwarefd, const struct stat *st, FirmwareStats *stats) {
+        return -EOPNOTSUPP;
+}
+#endif
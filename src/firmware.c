@@ -1,17 +1,176 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
-#include <sys/sendfile.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 
 #include "firmware.h"
+#include "firmware-backend.h"
+#include "firmware-decompress.h"
+#include "firmware-uring.h"
 #include "log-util.h"
+#include "time-util.h"
 
 #define LOADING_START   (1)
 #define LOADING_CANCEL  (-1)
 #define LOADING_FINISH  (0)
 
+#define WRITE_TIMEOUT_MSEC (5000)
+
+/* each backend uploads this much of the first firmware seen on a filesystem to find the fastest */
+#define PROBE_SIZE (16 * 1024)
+#define BACKEND_CACHE_SIZE (32)
+
+static size_t chunk_size = FIRMWARE_CHUNK_SIZE_DEFAULT;
+static const FirmwareBackend *forced_backend;
+#ifdef HAVE_IO_URING
+static bool use_io_uring = true;
+#else
+static bool use_io_uring = false;
+#endif
+
+/* transfer and write calls made by the current synchronous upload */
+static __thread unsigned int n_transfer_calls;
+
+/* the backend chosen for each filesystem, by st_dev */
+static pthread_mutex_t backend_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+        dev_t dev;
+        const FirmwareBackend *backend;
+} backend_cache[BACKEND_CACHE_SIZE];
+static unsigned int backend_cache_size;
+static unsigned int backend_cache_next;
+
+void firmware_set_chunk_size(size_t size) {
+        chunk_size = size > 0 ? size : FIRMWARE_CHUNK_SIZE_DEFAULT;
+}
+
+size_t firmware_get_chunk_size(void) {
+        return chunk_size;
+}
+
+int firmware_set_io_uring(bool enable) {
+#ifdef HAVE_IO_URING
+        use_io_uring = enable;
+        return 0;
+#else
+        return enable ? -EOPNOTSUPP : 0;
+#endif
+}
+
+int firmware_set_backend(const char *name) {
+        if (!name || strcmp(name, "auto") == 0) {
+                forced_backend = NULL;
+                return 0;
+        }
+
+        for (unsigned int i = 0; firmware_backends[i]; i ++)
+                if (strcmp(firmware_backends[i]->name, name) == 0) {
+                        forced_backend = firmware_backends[i];
+                        return 0;
+                }
+
+        return -EINVAL;
+}
+
+static const char * const format_suffixes[_FIRMWARE_FORMAT_MAX] = {
+        [FIRMWARE_FORMAT_RAW] = "",
+        [FIRMWARE_FORMAT_ZSTD] = ".zst",
+        [FIRMWARE_FORMAT_XZ] = ".xz",
+};
+
+static const char * const format_names[_FIRMWARE_FORMAT_MAX] = {
+        [FIRMWARE_FORMAT_RAW] = "raw",
+        [FIRMWARE_FORMAT_ZSTD] = "zstd",
+        [FIRMWARE_FORMAT_XZ] = "xz",
+};
+
+bool firmware_format_supported(FirmwareFormat format) {
+        switch (format) {
+        case FIRMWARE_FORMAT_RAW:
+                return true;
+#ifdef HAVE_ZSTD
+        case FIRMWARE_FORMAT_ZSTD:
+                return true;
+#endif
+#ifdef HAVE_XZ
+        case FIRMWARE_FORMAT_XZ:
+                return true;
+#endif
+        default:
+                return false;
+        }
+}
+
+const char *firmware_format_suffix(FirmwareFormat format) {
+        return format_suffixes[format];
+}
+
+/* strips the suffix of a supported compression format off @path, and returns the format it implies */
+FirmwareFormat firmware_format_strip_suffix(char *path) {
+        size_t len = strlen(path);
+
+        for (FirmwareFormat format = FIRMWARE_FORMAT_RAW + 1; format < _FIRMWARE_FORMAT_MAX; format ++) {
+                size_t suffix_len = strlen(format_suffixes[format]);
+
+                if (!firmware_format_supported(format))
+                        continue;
+
+                if (len > suffix_len && strcmp(path + len - suffix_len, format_suffixes[format]) == 0) {
+                        path[len - suffix_len] = '\0';
+                        return format;
+                }
+        }
+
+        return FIRMWARE_FORMAT_RAW;
+}
+
+static const FirmwareBackend *backend_cache_get(dev_t dev) {
+        const FirmwareBackend *backend = NULL;
+
+        pthread_mutex_lock(&backend_cache_lock);
+        for (unsigned int i = 0; i < backend_cache_size; i ++)
+                if (backend_cache[i].dev == dev) {
+                        backend = backend_cache[i].backend;
+                        break;
+                }
+        pthread_mutex_unlock(&backend_cache_lock);
+
+        return backend;
+}
+
+static void backend_cache_put(dev_t dev, const FirmwareBackend *backend) {
+        unsigned int i;
+
+        pthread_mutex_lock(&backend_cache_lock);
+
+        for (i = 0; i < backend_cache_size; i ++)
+                if (backend_cache[i].dev == dev)
+                        break;
+
+        if (i == backend_cache_size) {
+                if (backend_cache_size < BACKEND_CACHE_SIZE)
+                        backend_cache_size ++;
+                else
+                        i = backend_cache_next++ % BACKEND_CACHE_SIZE;
+        }
+
+        backend_cache[i].dev = dev;
+        backend_cache[i].backend = backend;
+
+        pthread_mutex_unlock(&backend_cache_lock);
+}
+
+static bool backend_unsupported(int r) {
+        return r == -EINVAL || r == -ENOSYS || r == -EOPNOTSUPP || r == -ENODEV;
+}
+
 static int firmware_set_loading(int loadingfd, int state) {
         int r;
 
@@ -22,12 +181,203 @@ static int firmware_set_loading(int loadingfd, int state) {
         return 0;
 }
 
-int firmware_load(int devicefd, int firmwarefd, bool tentative) {
+static int firmware_wait_writable(int datafd) {
+        struct pollfd pollfd = {
+                .fd = datafd,
+                .events = POLLOUT,
+        };
+        int r;
+
+        do
+                r = poll(&pollfd, 1, WRITE_TIMEOUT_MSEC);
+        while (r < 0 && errno == EINTR);
+
+        if (r < 0)
+                return -errno;
+        else if (r == 0)
+                return -ETIMEDOUT;
+        else if (pollfd.revents & (POLLERR|POLLHUP))
+                return -EIO;
+
+        return 0;
+}
+
+static int firmware_write_all(int datafd, const char *buf, size_t size) {
+        int r;
+
+        while (size > 0) {
+                ssize_t n;
+
+                n_transfer_calls ++;
+                n = write(datafd, buf, size);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        if (errno == EAGAIN) {
+                                r = firmware_wait_writable(datafd);
+                                if (r < 0)
+                                        return r;
+
+                                continue;
+                        }
+
+                        return -errno;
+                } else if (n == 0)
+                        return -EIO;
+
+                buf += n;
+                size -= n;
+        }
+
+        return 0;
+}
+
+static int firmware_write_sink(const void *buf, size_t size, void *userdata) {
+        int *datafdp = userdata;
+
+        return firmware_write_all(*datafdp, buf, size);
+}
+
+/* stream [*offsetp, end) in chunks, resuming short transfers where they stopped */
+static int firmware_transfer_range(const FirmwareBackend *backend, int datafd, int firmwarefd,
+                                   off_t *offsetp, off_t end) {
+        int r;
+
+        while (*offsetp < end) {
+                size_t count = end - *offsetp < (off_t) chunk_size ? (size_t) (end - *offsetp) : chunk_size;
+                ssize_t n;
+
+                n_transfer_calls ++;
+                n = backend->transfer(datafd, firmwarefd, *offsetp, count);
+                if (n < 0) {
+                        if (n == -EINTR)
+                                continue;
+
+                        if (n == -EAGAIN) {
+                                r = firmware_wait_writable(datafd);
+                                if (r < 0)
+                                        return r;
+
+                                continue;
+                        }
+
+                        return n;
+                } else if (n == 0) {
+                        log_warn("firmware truncated at %llu of %llu bytes",
+                                 (unsigned long long) *offsetp, (unsigned long long) end);
+                        return -EIO;
+                }
+
+                *offsetp += n;
+        }
+
+        return 0;
+}
+
+/* upload a slice of the firmware with each backend in turn and remember the fastest for this filesystem */
+static int firmware_probe_backend(int datafd, int firmwarefd, const struct stat *st,
+                                  off_t *offsetp, const FirmwareBackend **backendp) {
+        const FirmwareBackend *best = NULL;
+        uint64_t best_rate = 0;
+        int r = -EOPNOTSUPP;
+
+        posix_fadvise(firmwarefd, 0, st->st_size, POSIX_FADV_WILLNEED);
+
+        for (unsigned int i = 0; firmware_backends[i]; i ++) {
+                off_t start = *offsetp;
+                uint64_t begin_usec, rate;
+
+                begin_usec = now_usec();
+                r = firmware_transfer_range(firmware_backends[i], datafd, firmwarefd, offsetp, start + PROBE_SIZE);
+                if (r < 0) {
+                        if (backend_unsupported(r))
+                                continue;
+
+                        return r;
+                }
+
+                rate = (uint64_t) (*offsetp - start) * USEC_PER_SEC / ((now_usec() - begin_usec) ?: 1);
+                if (!best || rate > best_rate) {
+                        best = firmware_backends[i];
+                        best_rate = rate;
+                }
+        }
+
+        if (!best)
+                return r;
+
+        log_info("using %s upload backend for firmware on device %u:%u (%llu KiB/s)", best->name,
+                 major(st->st_dev), minor(st->st_dev), (unsigned long long) (best_rate / 1024));
+        backend_cache_put(st->st_dev, best);
+        *backendp = best;
+
+        return 0;
+}
+
+static int firmware_transfer(int datafd, int firmwarefd, const struct stat *st, const char **backendp) {
+        const FirmwareBackend *backend;
+        off_t offset = 0;
+        int r;
+
+        backend = forced_backend;
+        if (!backend)
+                backend = backend_cache_get(st->st_dev);
+        if (!backend && st->st_size >= 3 * PROBE_SIZE) {
+                r = firmware_probe_backend(datafd, firmwarefd, st, &offset, &backend);
+                if (r < 0)
+                        return r;
+        }
+        if (!backend)
+                backend = firmware_backends[0];
+
+        for (;;) {
+                unsigned int i;
+
+                r = firmware_transfer_range(backend, datafd, firmwarefd, &offset, st->st_size);
+                if (r >= 0 || forced_backend || !backend_unsupported(r))
+                        break;
+
+                for (i = 0; firmware_backends[i] != backend; i ++)
+                        ;
+                if (!firmware_backends[i + 1])
+                        break;
+
+                log_info("%s upload backend not usable for firmware on device %u:%u (%s), falling back to %s",
+                         backend->name, major(st->st_dev), minor(st->st_dev), strerror(-r),
+                         firmware_backends[i + 1]->name);
+                backend = firmware_backends[i + 1];
+                backend_cache_put(st->st_dev, backend);
+        }
+
+        *backendp = backend->name;
+
+        return r;
+}
+
+int firmware_load(int devicefd, int firmwarefd, FirmwareFormat format, bool tentative, FirmwareStats *stats) {
         int loadingfd = -1, datafd = -1;
         struct stat statbuf;
         bool started = false;
+        const char *backend;
+        uint64_t begin_usec, size;
         int r;
 
+        if (use_io_uring && format == FIRMWARE_FORMAT_RAW &&
+            fstat(firmwarefd, &statbuf) >= 0 && statbuf.st_size > 0) {
+                r = firmware_uring_load(devicefd, firmwarefd, &statbuf, stats);
+                if (r >= 0) {
+                        if (stats)
+                                stats->n_syscalls ++;
+                        return 0;
+                }
+
+                if (r != -EOPNOTSUPP)
+                        log_info("io_uring upload failed (%s), retrying synchronously", strerror(-r));
+        }
+
+        n_transfer_calls = 0;
+
         loadingfd = openat(devicefd, "loading", O_CLOEXEC|O_WRONLY);
         if (loadingfd < 0) {
                 r = -errno;
@@ -56,34 +406,220 @@ int firmware_load(int devicefd, int firmwarefd, bool tentative) {
                 goto finish;
 
         started = true;
+        begin_usec = now_usec();
 
-        while (statbuf.st_size) {
-                ssize_t size;
-                off_t offset = 0;
+        if (format == FIRMWARE_FORMAT_RAW) {
+                r = firmware_transfer(datafd, firmwarefd, &statbuf, &backend);
+                size = statbuf.st_size;
+        } else {
+                uint64_t cpu_usec = thread_cpu_usec();
 
-                size = sendfile(datafd, firmwarefd, &offset, statbuf.st_size);
-                if (size < 0) {
-                        r = -errno;
-                        goto finish;
+                r = firmware_decompress(format, firmwarefd, firmware_write_sink, &datafd, &size);
+                backend = format_names[format];
+                if (stats)
+                        stats->decompress_usec = thread_cpu_usec() - cpu_usec;
+                if (r >= 0 && size == 0) {
+                        log_warn("decompressed firmware is empty; ignoring request");
+                        r = -EIO;
                 }
+        }
+        if (r < 0)
+                goto finish;
 
-                statbuf.st_size -= size;
+        if (stats) {
+                stats->size = size;
+                stats->usec = now_usec() - begin_usec;
+                stats->backend = backend;
+                /* opening and closing loading and data, fstat, both loading writes and the transfer */
+                stats->n_syscalls = 7 + n_transfer_calls;
+                stats->loading_usec = begin_usec;
+                stats->transferred_usec = begin_usec + stats->usec;
         }
 
-        firmware_set_loading(loadingfd, LOADING_FINISH);
+        r = firmware_set_loading(loadingfd, LOADING_FINISH);
+        if (stats)
+                stats->finished_usec = now_usec();
 
 finish:
+        if (r < 0 && r != -ENOENT && (!tentative || started) && loadingfd >= 0)
+                firmware_set_loading(loadingfd, LOADING_CANCEL);
         if (loadingfd >= 0)
                 close(loadingfd);
         if (datafd >= 0)
                 close(datafd);
-        if (r < 0 && r != -ENOENT && (!tentative || started)) {
-                firmware_set_loading(loadingfd, LOADING_CANCEL);
+        if (r < 0 && r != -ENOENT && (!tentative || started))
                 return r;
-        } else
+        else
                 return 0;
 }
 
+typedef struct FanoutTarget {
+        int loadingfd;
+        int datafd;
+        int error;
+        bool started;
+} FanoutTarget;
+
+struct fanout_sink {
+        FanoutTarget *targets;
+        unsigned int n;
+        unsigned int n_live;
+};
+
+/* writes every buffer to each device still loading, a failing device is left behind */
+static int firmware_fanout_sink(const void *buf, size_t size, void *userdata) {
+        struct fanout_sink *sink = userdata;
+
+        for (unsigned int i = 0; i < sink->n; i ++) {
+                FanoutTarget *target = &sink->targets[i];
+                int r;
+
+                if (target->error < 0)
+                        continue;
+
+                r = firmware_write_all(target->datafd, buf, size);
+                if (r < 0) {
+                        target->error = r;
+                        sink->n_live --;
+                }
+        }
+
+        return sink->n_live > 0 ? 0 : -EIO;
+}
+
+/*
+ * Uploads the same firmware to @n devices, reading it only once: uncompressed
+ * firmware is mapped and every chunk written to each device in turn,
+ * compressed firmware is decompressed once and each decompressed buffer
+ * handed to every device. The outcome for each device is returned in
+ * @results, with the same semantics as the return value of firmware_load().
+ * Fails before touching any device if the firmware cannot be mapped, so the
+ * caller may fall back to firmware_load() for each device.
+ */
+int firmware_load_many(unsigned int n, const int *devicefds, int firmwarefd, FirmwareFormat format,
+                       bool tentative, int *results, FirmwareStats *stats) {
+        struct fanout_sink sink = {
+                .n = n,
+        };
+        struct stat statbuf;
+        void *map = MAP_FAILED;
+        const char *backend;
+        uint64_t begin_usec, size = 0;
+        int r;
+
+        if (fstat(firmwarefd, &statbuf) < 0)
+                return -errno;
+
+        if (statbuf.st_size == 0)
+                return -EIO;
+
+        if (format == FIRMWARE_FORMAT_RAW) {
+                map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, firmwarefd, 0);
+                if (map == MAP_FAILED)
+                        return -errno;
+
+                madvise(map, statbuf.st_size, MADV_SEQUENTIAL|MADV_WILLNEED);
+        }
+
+        sink.targets = calloc(n, sizeof(FanoutTarget));
+        if (!sink.targets) {
+                if (map != MAP_FAILED)
+                        munmap(map, statbuf.st_size);
+                return -ENOMEM;
+        }
+
+        n_transfer_calls = 0;
+
+        for (unsigned int i = 0; i < n; i ++) {
+                FanoutTarget *target = &sink.targets[i];
+
+                target->datafd = -1;
+                target->loadingfd = openat(devicefds[i], "loading", O_CLOEXEC|O_WRONLY);
+                if (target->loadingfd < 0) {
+                        target->error = -errno;
+                        continue;
+                }
+
+                target->datafd = openat(devicefds[i], "data", O_CLOEXEC|O_WRONLY);
+                if (target->datafd < 0) {
+                        target->error = -errno;
+                        continue;
+                }
+
+                target->error = firmware_set_loading(target->loadingfd, LOADING_START);
+                if (target->error < 0)
+                        continue;
+
+                target->started = true;
+                sink.n_live ++;
+        }
+
+        begin_usec = now_usec();
+
+        if (sink.n_live == 0)
+                r = 0;
+        else if (format == FIRMWARE_FORMAT_RAW) {
+                for (r = 0; r >= 0 && size < (uint64_t) statbuf.st_size; ) {
+                        size_t count = statbuf.st_size - size < chunk_size ? (size_t) (statbuf.st_size - size) : chunk_size;
+
+                        r = firmware_fanout_sink((const char *) map + size, count, &sink);
+                        size += count;
+                }
+                backend = "mmap";
+        } else {
+                uint64_t cpu_usec = thread_cpu_usec();
+
+                r = firmware_decompress(format, firmwarefd, firmware_fanout_sink, &sink, &size);
+                backend = format_names[format];
+                if (stats)
+                        stats->decompress_usec = thread_cpu_usec() - cpu_usec;
+                if (r >= 0 && size == 0) {
+                        log_warn("decompressed firmware is empty; ignoring request");
+                        r = -EIO;
+                }
+        }
+
+        if (stats && sink.n_live > 0) {
+                stats->size = size;
+                stats->usec = now_usec() - begin_usec;
+                stats->backend = backend;
+                /* opening and closing loading and data and both loading writes for each device, fstat and the transfer */
+                stats->n_syscalls = 6 * n + 1 + n_transfer_calls;
+                stats->loading_usec = begin_usec;
+                stats->transferred_usec = begin_usec + stats->usec;
+        }
+
+        for (unsigned int i = 0; i < n; i ++) {
+                FanoutTarget *target = &sink.targets[i];
+
+                /* a decompression error fails every device still loading */
+                if (target->error == 0 && target->started)
+                        target->error = r < 0 ? r : firmware_set_loading(target->loadingfd, LOADING_FINISH);
+
+                if (target->error < 0 && target->error != -ENOENT && (!tentative || target->started) &&
+                    target->loadingfd >= 0)
+                        firmware_set_loading(target->loadingfd, LOADING_CANCEL);
+                if (target->loadingfd >= 0)
+                        close(target->loadingfd);
+                if (target->datafd >= 0)
+                        close(target->datafd);
+
+                if (target->error < 0 && target->error != -ENOENT && (!tentative || target->started))
+                        results[i] = target->error;
+                else
+                        results[i] = 0;
+        }
+
+        if (stats && sink.n_live > 0)
+                stats->finished_usec = now_usec();
+
+        free(sink.targets);
+        if (map != MAP_FAILED)
+                munmap(map, statbuf.st_size);
+
+        return 0;
+}
+
 int firmware_cancel_load(int devicefd) {
         int loadingfd;
         int r;
@@ -104,3 +640,88 @@ finish:
         else
                 return 0;
 }
+
+struct image_sink {
+        int memfd;
+        uint64_t size;
+        uint64_t max_size;
+};
+
+static int firmware_image_sink(const void *buf, size_t size, void *userdata) {
+        struct image_sink *sink = userdata;
+
+        if (sink->size + size > sink->max_size)
+                return -EFBIG;
+
+        sink->size += size;
+
+        return firmware_write_all(sink->memfd, buf, size);
+}
+
+/*
+ * Decompresses the firmware into a sealed memfd, which can then be uploaded
+ * like any uncompressed firmware. Fails with -EFBIG if the image would be
+ * larger than @max_size.
+ */
+int firmware_decompress_image(int firmwarefd, FirmwareFormat format, uint64_t max_size, int *memfdp, FirmwareStats *stats) {
+        struct image_sink sink = {
+                .max_size = max_size,
+        };
+        uint64_t cpu_usec, size;
+        int r;
+
+        sink.memfd = memfd_create("firmware", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+        if (sink.memfd < 0)
+                return -errno;
+
+        cpu_usec = thread_cpu_usec();
+        r = firmware_decompress(format, firmwarefd, firmware_image_sink, &sink, &size);
+        if (r < 0)
+                goto fail;
+
+        if (fcntl(sink.memfd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        if (stats) {
+                stats->size = size;
+                stats->decompress_usec = thread_cpu_usec() - cpu_usec;
+                stats->backend = format_names[format];
+        }
+
+        *memfdp = sink.memfd;
+
+        return 0;
+
+fail:
+        close(sink.memfd);
+        return r;
+}
+
+/*
+ * Opens the first of @paths, each relative to the matching entry of @dirfds,
+ * that exists. Returns the fd and stores its index in @indexp, or returns
+ * -ENOENT if none exists.
+ */
+int firmware_open_first(unsigned int n, const int *dirfds, char * const *paths,
+                        unsigned int *indexp, unsigned int *n_syscallsp) {
+        int fd, r;
+
+        if (use_io_uring) {
+                r = firmware_uring_open_first(n, dirfds, paths, indexp, n_syscallsp);
+                if (r != -EOPNOTSUPP && r != -EBUSY)
+                        return r;
+        }
+
+        for (unsigned int i = 0; i < n; i ++) {
+                (*n_syscallsp) ++;
+                fd = openat(dirfds[i], paths[i], O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+                if (fd >= 0) {
+                        *indexp = i;
+                        return fd;
+                }
+        }
+
+        return -ENOENT;
+}
@@ -1,6 +1,46 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
-int firmware_load(int devicefd, int firmwarefd, bool tentative);
+#define FIRMWARE_CHUNK_SIZE_DEFAULT (1024 * 1024)
+
+/* in order of precedence within a search directory */
+typedef enum FirmwareFormat {
+        FIRMWARE_FORMAT_RAW,
+        FIRMWARE_FORMAT_ZSTD,
+        FIRMWARE_FORMAT_XZ,
+        _FIRMWARE_FORMAT_MAX,
+} FirmwareFormat;
+
+typedef struct FirmwareStats {
+        uint64_t size;
+        uint64_t usec;
+        const char *backend;
+        uint64_t decompress_usec;
+        unsigned int n_syscalls;
+        /* CLOCK_MONOTONIC times at which loading was set to 1, the last byte written and loading set to 0 */
+        uint64_t loading_usec;
+        uint64_t transferred_usec;
+        uint64_t finished_usec;
+} FirmwareStats;
+
+void firmware_set_chunk_size(size_t size);
+size_t firmware_get_chunk_size(void);
+int firmware_set_io_uring(bool enable);
+int firmware_set_backend(const char *name);
+
+bool firmware_format_supported(FirmwareFormat format);
+const char *firmware_format_suffix(FirmwareFormat format);
+FirmwareFormat firmware_format_strip_suffix(char *path);
+
+int firmware_load(int devicefd, int firmwarefd, FirmwareFormat format, bool tentative, FirmwareStats *stats);
+int firmware_load_many(unsigned int n, const int *devicefds, int firmwarefd, FirmwareFormat format,
+                       bool tentative, int *results, FirmwareStats *stats);
 int firmware_cancel_load(int devicefd);
+
+int firmware_open_first(unsigned int n, const int *dirfds, char * const *paths,
+                        unsigned int *indexp, unsigned int *n_syscallsp);
+
+int firmware_decompress_image(int firmwarefd, FirmwareFormat format, uint64_t max_size, int *memfdp, FirmwareStats *stats);
@@ -0,0 +1,198 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "log-util.h"
+
+/* commands and the number of arguments they take */
+static const struct {
+        const char *name;
+        int n_args;
+} commands[] = {
+        { "status",     0 },
+        { "list",       0 },
+        { "dirs",       0 },
+        { "rescan",     0 },
+        { "tentative",  1 },
+        { "add-dir",    1 },
+        { "remove-dir", 1 },
+};
+
+static void usage(void) {
+	printf("firmwarectl - Control a running firmwared\n"
+		"Usage:\n");
+	printf("\tfirmwarectl [options] command\n");
+	printf("Options:\n"
+		"\t-s, --socket [path]    Control socket of firmwared, see --control-socket\n"
+		"\t    --first            Add a directory with the highest precedence\n"
+		"\t-h, --help             Show help options\n");
+	printf("Commands:\n"
+		"\tstatus                 Show the mode and number of requests\n"
+		"\tlist                   List pending, queued and running requests\n"
+		"\tdirs                   List the search directories\n"
+		"\trescan                 Look up all firmware and requests again\n"
+		"\ttentative on|off       Switch mode, off cancels pending requests\n"
+		"\tadd-dir [path]         Add a search directory, last unless --first\n"
+		"\tremove-dir [path]      Remove a search directory\n");
+}
+
+enum {
+        ARG_FIRST = 0x100,
+};
+
+static const struct option main_options[] = {
+	{ "socket",        required_argument, NULL, 's' },
+	{ "first",         no_argument,       NULL, ARG_FIRST },
+	{ "help",          no_argument,       NULL, 'h' },
+	{ }
+};
+
+static int control_connect(const char *path) {
+        struct sockaddr_un address = {
+                .sun_family = AF_UNIX,
+        };
+        int fd;
+
+        if (strlen(path) >= sizeof(address.sun_path))
+                return -ENAMETOOLONG;
+        strcpy(address.sun_path, path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        if (fd < 0)
+                return -errno;
+
+        if (connect(fd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+                int r = -errno;
+
+                close(fd);
+                return r;
+        }
+
+        return fd;
+}
+
+static int write_all(int fd, const char *buf, size_t size) {
+        while (size > 0) {
+                ssize_t n;
+
+                n = send(fd, buf, size, MSG_NOSIGNAL);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -errno;
+                }
+
+                buf += n;
+                size -= n;
+        }
+
+        return 0;
+}
+
+/* prints the response, a command that failed answers with a line starting with "error:" only */
+static int read_response(int fd, bool *failedp) {
+        char buf[4096];
+        size_t total = 0;
+
+        for (;;) {
+                ssize_t n;
+
+                n = recv(fd, buf, sizeof(buf), 0);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -errno;
+                } else if (n == 0)
+                        return 0;
+
+                if (total == 0 && (size_t) n >= strlen("error:") && memcmp(buf, "error:", strlen("error:")) == 0)
+                        *failedp = true;
+                total += n;
+
+                fwrite(buf, 1, n, stdout);
+        }
+}
+
+int main(int argc, char **argv) {
+        const char *socket_path = NULL, *where = "last";
+        char request[4096];
+        bool failed = false;
+        size_t size;
+        int fd, r;
+
+        for (;;) {
+                int opt;
+
+                opt = getopt_long(argc, argv, "s:h", main_options, NULL);
+                if (opt < 0)
+                        break;
+
+                switch (opt) {
+                case 's':
+                        socket_path = optarg;
+                        break;
+                case ARG_FIRST:
+                        where = "first";
+                        break;
+                case 'h':
+                        usage();
+                        return EXIT_SUCCESS;
+                default:
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if (!socket_path) {
+                log_error("no control socket given, see --socket");
+                return EXIT_FAILURE;
+        }
+
+        if (optind >= argc) {
+                usage();
+                return EXIT_FAILURE;
+        }
+
+        r = -EINVAL;
+        for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i ++)
+                if (strcmp(argv[optind], commands[i].name) == 0 && argc - optind - 1 == commands[i].n_args)
+                        r = 0;
+        if (r < 0) {
+                log_error("unknown command or wrong number of arguments: %s", argv[optind]);
+                return EXIT_FAILURE;
+        }
+
+        /* the daemon reads a single line, the path of add-dir goes last */
+        if (strcmp(argv[optind], "add-dir") == 0)
+                r = snprintf(request, sizeof(request), "add-dir %s %s\n", where, argv[optind + 1]);
+        else if (optind + 1 < argc)
+                r = snprintf(request, sizeof(request), "%s %s\n", argv[optind], argv[optind + 1]);
+        else
+                r = snprintf(request, sizeof(request), "%s\n", argv[optind]);
+        if (r < 0 || (size_t) r >= sizeof(request) || strchr(request, '\n') != request + r - 1) {
+                log_error("invalid argument");
+                return EXIT_FAILURE;
+        }
+        size = r;
+
+        fd = control_connect(socket_path);
+        if (fd < 0) {
+                log_error("could not connect to %s: %s", socket_path, strerror(-fd));
+                return EXIT_FAILURE;
+        }
+
+        r = write_all(fd, request, size);
+        if (r >= 0)
+                r = read_response(fd, &failed);
+        close(fd);
+        if (r < 0) {
+                log_error("could not talk to firmwared: %s", strerror(-r));
+                return EXIT_FAILURE;
+        }
+
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
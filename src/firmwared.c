@@ -2,7 +2,10 @@
 #include <string.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
 
+#include "firmware.h"
 #include "manager.h"
 #include "log-util.h"
 
@@ -12,8 +15,8 @@ static const char* const firmware_builtin_dirs[] = {
 	FIRMWARE_PATH
 };
 
-char **firmware_dirs = NULL;
-size_t firmware_dirs_size;
+static char **firmware_dirs = NULL;
+static size_t firmware_dirs_size;
 
 static int setup_firmware_dirs(char *dirs) {
         char *token;
@@ -21,7 +24,7 @@ static int setup_firmware_dirs(char *dirs) {
         size_t i = 0, j;
 
         /* First, the runtime defined lookup paths */
-        token = strtok(dirs, ":");
+        token = dirs ? strtok(dirs, ":") : NULL;
         while (token) {
                 p = realloc(firmware_dirs, (i + 1) * sizeof(char*));
                 if (!p)
@@ -41,11 +44,14 @@ static int setup_firmware_dirs(char *dirs) {
         if (!p)
                 return -ENOMEM;
         firmware_dirs = p;
-        memset(&firmware_dirs[i], 0, ELEMENTSOF(firmware_builtin_dirs));
+        memset(&firmware_dirs[i], 0, ELEMENTSOF(firmware_builtin_dirs) * sizeof(char *));
         firmware_dirs_size = i + ELEMENTSOF(firmware_builtin_dirs);
 
-        for (j = i; j < firmware_dirs_size; j++)
+        for (j = i; j < firmware_dirs_size; j++) {
                 firmware_dirs[j] = strdup(firmware_builtin_dirs[j - i]);
+                if (!firmware_dirs[j])
+                        return -ENOMEM;
+        }
 
         return 0;
 }
@@ -61,6 +67,90 @@ static void cleanup_firmware_dirs(void) {
                 free(firmware_dirs);
 }
 
+static int parse_size(const char *str, uint64_t *sizep) {
+        unsigned long long size;
+        unsigned int shift = 0;
+        char *end;
+
+        /* strtoull() takes a leading minus and negates the result */
+        if (strchr(str, '-'))
+                return -EINVAL;
+
+        errno = 0;
+        size = strtoull(str, &end, 10);
+        if (errno > 0)
+                return -errno;
+        if (end == str)
+                return -EINVAL;
+
+        switch (*end) {
+        case 'G':
+                shift += 10;
+                /* fall through */
+        case 'M':
+                shift += 10;
+                /* fall through */
+        case 'K':
+                shift += 10;
+                end ++;
+                break;
+        }
+
+        if (size > (UINT64_MAX >> shift))
+                return -ERANGE;
+        size <<= shift;
+
+        if (*end)
+                return -EINVAL;
+
+        *sizep = size;
+
+        return 0;
+}
+
+static int parse_jobs(const char *str, unsigned int *jobsp) {
+        unsigned long jobs;
+        char *end;
+
+        if (strchr(str, '-'))
+                return -EINVAL;
+
+        errno = 0;
+        jobs = strtoul(str, &end, 10);
+        if (errno > 0)
+                return -errno;
+        if (end == str || *end || jobs == 0)
+                return -EINVAL;
+        if (jobs > MANAGER_MAX_JOBS)
+                return -ERANGE;
+
+        *jobsp = jobs;
+
+        return 0;
+}
+
+/* parses "N:PATTERN" */
+static int parse_priority_class(char *str, ManagerPriorityClass *class) {
+        char *end;
+        long priority;
+
+        errno = 0;
+        priority = strtol(str, &end, 10);
+        if (errno > 0)
+                return -errno;
+        if (end == str || *end != ':' || !end[1] || priority < INT_MIN || priority > INT_MAX)
+                return -EINVAL;
+
+        class->priority = priority;
+        class->pattern = end + 1;
+
+        return 0;
+}
+
+static void priority_classes_freep(ManagerPriorityClass **classesp) {
+        free(*classesp);
+}
+
 static void usage(void) {
 	printf("firmwared - Linux Firmware Loader Daemon\n"
 		"Usage:\n");
@@ -68,19 +158,78 @@ static void usage(void) {
 	printf("Options:\n"
 		"\t-t, --tentative        Defer loading of non existing firmwares\n"
 		"\t-d, --dirs [paths]     Firmware loading paths\n"
+		"\t    --dirs-file [path]\n"
+		"\t                       Firmware loading paths, one per line, searched first\n"
+		"\t                       and read again on SIGHUP\n"
+		"\t-j, --jobs [n]         Number of parallel firmware uploads\n"
+		"\t    --coldplug-jobs [n]\n"
+		"\t                       Parallel uploads for requests pending at startup (default jobs)\n"
+		"\t    --chunk-size [n]   Upload chunk size in bytes (K, M, G suffixes)\n"
+		"\t    --cache-size [n]   Size of the firmware cache in bytes, 0 to disable\n"
+		"\t    --image-cache-size [n]\n"
+		"\t                       Memory for decompressed firmware in bytes, 0 to disable\n"
+		"\t    --upload-backend [name]\n"
+		"\t                       Upload with sendfile, mmap or pread (default auto)\n"
+		"\t    --no-io-uring      Do not use io_uring for lookup and upload\n"
+		"\t    --receive-buffer-size [n]\n"
+		"\t                       Size of the uevent socket buffer in bytes\n"
+		"\t    --schedule [policy]\n"
+		"\t                       Upload order: fifo, edf, sjf or priority (default fifo)\n"
+		"\t    --priority-class [n:pattern]\n"
+		"\t                       Class of firmware names, or DEVPATHs if the pattern starts\n"
+		"\t                       with a slash, for the priority policy (default 0, highest first)\n"
+		"\t    --metrics-socket [path]\n"
+		"\t                       Serve metrics in Prometheus text format on a Unix socket,\n"
+		"\t                       to the user and group of firmwared\n"
+		"\t    --control-socket [path]\n"
+		"\t                       Take commands from firmwarectl on a Unix socket\n"
 		"\t-h, --help             Show help options\n");
 }
 
+enum {
+        ARG_CHUNK_SIZE = 0x100,
+        ARG_CACHE_SIZE,
+        ARG_IMAGE_CACHE_SIZE,
+        ARG_UPLOAD_BACKEND,
+        ARG_NO_IO_URING,
+        ARG_COLDPLUG_JOBS,
+        ARG_RECEIVE_BUFFER_SIZE,
+        ARG_SCHEDULE,
+        ARG_PRIORITY_CLASS,
+        ARG_METRICS_SOCKET,
+        ARG_CONTROL_SOCKET,
+        ARG_DIRS_FILE,
+};
+
 static const struct option main_options[] = {
 	{ "tentative",     no_argument,       NULL, 't' },
 	{ "dirs",          required_argument, NULL, 'd' },
+	{ "dirs-file",     required_argument, NULL, ARG_DIRS_FILE },
+	{ "jobs",          required_argument, NULL, 'j' },
+	{ "chunk-size",    required_argument, NULL, ARG_CHUNK_SIZE },
+	{ "cache-size",    required_argument, NULL, ARG_CACHE_SIZE },
+	{ "image-cache-size", required_argument, NULL, ARG_IMAGE_CACHE_SIZE },
+	{ "upload-backend", required_argument, NULL, ARG_UPLOAD_BACKEND },
+	{ "no-io-uring",   no_argument,       NULL, ARG_NO_IO_URING },
+	{ "coldplug-jobs", required_argument, NULL, ARG_COLDPLUG_JOBS },
+	{ "receive-buffer-size", required_argument, NULL, ARG_RECEIVE_BUFFER_SIZE },
+	{ "schedule",      required_argument, NULL, ARG_SCHEDULE },
+	{ "priority-class", required_argument, NULL, ARG_PRIORITY_CLASS },
+	{ "metrics-socket", required_argument, NULL, ARG_METRICS_SOCKET },
+	{ "control-socket", required_argument, NULL, ARG_CONTROL_SOCKET },
 	{ "help",          no_argument,       NULL, 'h' },
 	{ }
 };
 
 int main(int argc, char **argv) {
+        /* freed after the manager, which refers to them */
+        _cleanup_(priority_classes_freep) ManagerPriorityClass *priority_classes = NULL;
         _cleanup_(manager_freep) Manager *manager = NULL;
-        bool tentative = false;
+        ManagerConfig config = {
+                .n_workers = 4,
+                .cache_size = 64 * 1024 * 1024,
+                .image_cache_size = 64 * 1024 * 1024,
+        };
         char *dirs = NULL;
         int r;
 
@@ -89,17 +238,101 @@ int main(int argc, char **argv) {
         for (;;) {
                 int opt;
 
-                opt = getopt_long(argc, argv, "td:h", main_options, NULL);
+                opt = getopt_long(argc, argv, "td:j:h", main_options, NULL);
                 if (opt < 0)
                         break;
 
                 switch (opt) {
                 case 't':
-                        tentative = true;
+                        config.tentative = true;
                         break;
                 case 'd':
                         dirs = optarg;
                         break;
+                case ARG_DIRS_FILE:
+                        config.dirs_file = optarg;
+                        break;
+                case 'j':
+                        if (parse_jobs(optarg, &config.n_workers) < 0) {
+                                log_error("invalid number of jobs '%s', expected 1 to %u", optarg, MANAGER_MAX_JOBS);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case ARG_CHUNK_SIZE: {
+                        uint64_t size;
+
+                        if (parse_size(optarg, &size) < 0 || size == 0 || size > SSIZE_MAX) {
+                                log_error("invalid chunk size '%s'", optarg);
+                                return EXIT_FAILURE;
+                        }
+
+                        firmware_set_chunk_size(size);
+                        break;
+                }
+                case ARG_CACHE_SIZE:
+                        if (parse_size(optarg, &config.cache_size) < 0) {
+                                log_error("invalid cache size '%s'", optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case ARG_IMAGE_CACHE_SIZE:
+                        if (parse_size(optarg, &config.image_cache_size) < 0) {
+                                log_error("invalid image cache size '%s'", optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case ARG_UPLOAD_BACKEND:
+                        if (firmware_set_backend(optarg) < 0) {
+                                log_error("unknown upload backend '%s'", optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case ARG_NO_IO_URING:
+                        firmware_set_io_uring(false);
+                        break;
+                case ARG_COLDPLUG_JOBS:
+                        if (parse_jobs(optarg, &config.n_coldplug_jobs) < 0) {
+                                log_error("invalid number of coldplug jobs '%s', expected 1 to %u", optarg,
+                                          MANAGER_MAX_JOBS);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case ARG_RECEIVE_BUFFER_SIZE:
+                        if (parse_size(optarg, &config.receive_buffer_size) < 0 ||
+                            config.receive_buffer_size > INT_MAX) {
+                                log_error("invalid receive buffer size '%s'", optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case ARG_SCHEDULE:
+                        if (queue_policy_from_string(optarg, &config.policy) < 0) {
+                                log_error("unknown scheduling policy '%s'", optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case ARG_PRIORITY_CLASS: {
+                        ManagerPriorityClass *classes;
+
+                        classes = realloc(priority_classes, (config.n_priority_classes + 1) * sizeof(*classes));
+                        if (!classes)
+                                return EXIT_FAILURE;
+                        priority_classes = classes;
+
+                        if (parse_priority_class(optarg, &priority_classes[config.n_priority_classes]) < 0) {
+                                log_error("invalid priority class '%s'", optarg);
+                                return EXIT_FAILURE;
+                        }
+
+                        config.priority_classes = priority_classes;
+                        config.n_priority_classes ++;
+                        break;
+                }
+                case ARG_METRICS_SOCKET:
+                        config.metrics_socket = optarg;
+                        break;
+                case ARG_CONTROL_SOCKET:
+                        config.control_socket = optarg;
+                        break;
                 case 'h':
                         usage();
                         return EXIT_SUCCESS;
@@ -108,11 +341,17 @@ int main(int argc, char **argv) {
                 }
         }
 
+        if (config.n_priority_classes > 0 && config.policy != QUEUE_POLICY_PRIORITY)
+                log_warn("priority classes are only used by the priority scheduling policy");
+
         r = setup_firmware_dirs(dirs);
         if (r < 0)
                 goto out;
 
-        r = manager_new(&manager, tentative);
+        config.dirs = firmware_dirs;
+        config.n_dirs = firmware_dirs_size;
+
+        r = manager_new(&manager, &config);
         if (r < 0) {
                 log_error("firmwared %s", strerror(-r));
                 goto out;
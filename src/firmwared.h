@@ -1,4 +0,0 @@
-#pragma once
-
-extern char **firmware_dirs;
-extern size_t firmware_dirs_size;
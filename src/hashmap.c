@@ -0,0 +1,188 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+#define HASHMAP_MIN_BUCKETS (16)
+
+struct HashmapEntry {
+        HashmapEntry *next;
+        const char *key;
+        void *value;
+        uint32_t hash;
+};
+
+struct Hashmap {
+        HashmapEntry **buckets;
+        size_t n_buckets;
+        size_t size;
+};
+
+/* FNV-1a */
+static uint32_t string_hash(const char *key) {
+        uint32_t hash = 2166136261U;
+
+        for (const unsigned char *p = (const unsigned char*) key; *p; p ++) {
+                hash ^= *p;
+                hash *= 16777619U;
+        }
+
+        return hash;
+}
+
+int hashmap_new(Hashmap **hashmapp) {
+        Hashmap *hashmap;
+
+        hashmap = calloc(1, sizeof(*hashmap));
+        if (!hashmap)
+                return -ENOMEM;
+
+        hashmap->buckets = calloc(HASHMAP_MIN_BUCKETS, sizeof(HashmapEntry*));
+        if (!hashmap->buckets) {
+                free(hashmap);
+                return -ENOMEM;
+        }
+        hashmap->n_buckets = HASHMAP_MIN_BUCKETS;
+
+        *hashmapp = hashmap;
+
+        return 0;
+}
+
+void hashmap_free(Hashmap *hashmap) {
+        for (size_t i = 0; i < hashmap->n_buckets; i ++) {
+                HashmapEntry *entry = hashmap->buckets[i];
+
+                while (entry) {
+                        HashmapEntry *next = entry->next;
+
+                        free(entry);
+                        entry = next;
+                }
+        }
+
+        free(hashmap->buckets);
+        free(hashmap);
+}
+
+static void hashmap_resize(Hashmap *hashmap) {
+        HashmapEntry **buckets;
+        size_t n_buckets;
+
+        n_buckets = hashmap->n_buckets * 2;
+        buckets = calloc(n_buckets, sizeof(HashmapEntry*));
+        /* if we cannot grow, we keep working with longer chains */
+        if (!buckets)
+                return;
+
+        for (size_t i = 0; i < hashmap->n_buckets; i ++) {
+                HashmapEntry *entry = hashmap->buckets[i];
+
+                while (entry) {
+                        HashmapEntry *next = entry->next;
+                        size_t bucket = entry->hash & (n_buckets - 1);
+
+                        entry->next = buckets[bucket];
+                        buckets[bucket] = entry;
+                        entry = next;
+                }
+        }
+
+        free(hashmap->buckets);
+        hashmap->buckets = buckets;
+        hashmap->n_buckets = n_buckets;
+}
+
+static HashmapEntry **hashmap_find(Hashmap *hashmap, const char *key, uint32_t hash) {
+        HashmapEntry **entryp = &hashmap->buckets[hash & (hashmap->n_buckets - 1)];
+
+        for (; *entryp; entryp = &(*entryp)->next)
+                if ((*entryp)->hash == hash && strcmp((*entryp)->key, key) == 0)
+                        break;
+
+        return entryp;
+}
+
+int hashmap_put(Hashmap *hashmap, const char *key, void *value) {
+        HashmapEntry **entryp, *entry;
+        uint32_t hash;
+
+        hash = string_hash(key);
+        entryp = hashmap_find(hashmap, key, hash);
+        if (*entryp)
+                return -EEXIST;
+
+        entry = malloc(sizeof(*entry));
+        if (!entry)
+                return -ENOMEM;
+
+        entry->key = key;
+        entry->value = value;
+        entry->hash = hash;
+        entry->next = NULL;
+        *entryp = entry;
+
+        hashmap->size ++;
+        if (hashmap->size > hashmap->n_buckets * 3 / 4)
+                hashmap_resize(hashmap);
+
+        return 0;
+}
+
+void *hashmap_get(Hashmap *hashmap, const char *key) {
+        HashmapEntry *entry;
+
+        entry = *hashmap_find(hashmap, key, string_hash(key));
+
+        return entry ? entry->value : NULL;
+}
+
+void *hashmap_remove(Hashmap *hashmap, const char *key) {
+        HashmapEntry **entryp, *entry;
+        void *value;
+
+        entryp = hashmap_find(hashmap, key, string_hash(key));
+        entry = *entryp;
+        if (!entry)
+                return NULL;
+
+        *entryp = entry->next;
+        value = entry->value;
+        free(entry);
+        hashmap->size --;
+
+        return value;
+}
+
+size_t hashmap_size(Hashmap *hashmap) {
+        return hashmap->size;
+}
+
+size_t hashmap_memory(Hashmap *hashmap) {
+        return sizeof(*hashmap) +
+               hashmap->n_buckets * sizeof(HashmapEntry*) +
+               hashmap->size * sizeof(HashmapEntry);
+}
+
+/* the current entry may be removed while iterating, but no others */
+bool hashmap_iterate(Hashmap *hashmap, HashmapIterator *iterator, const char **keyp, void **valuep) {
+        HashmapEntry *entry = iterator->entry;
+
+        while (!entry) {
+                if (iterator->bucket >= hashmap->n_buckets)
+                        return false;
+
+                entry = hashmap->buckets[iterator->bucket ++];
+        }
+
+        iterator->entry = entry->next;
+
+        if (keyp)
+                *keyp = entry->key;
+        if (valuep)
+                *valuep = entry->value;
+
+        return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A string keyed hash table. Keys are not copied, they must stay valid for as
+ * long as the entry is in the table; usually they point into the value.
+ */
+
+typedef struct Hashmap Hashmap;
+typedef struct HashmapEntry HashmapEntry;
+
+typedef struct HashmapIterator {
+        size_t bucket;
+        HashmapEntry *entry;
+} HashmapIterator;
+
+#define HASHMAP_ITERATOR_FIRST ((HashmapIterator) {})
+
+int hashmap_new(Hashmap **hashmapp);
+void hashmap_free(Hashmap *hashmap);
+
+int hashmap_put(Hashmap *hashmap, const char *key, void *value);
+void *hashmap_get(Hashmap *hashmap, const char *key);
+void *hashmap_remove(Hashmap *hashmap, const char *key);
+size_t hashmap_size(Hashmap *hashmap);
+size_t hashmap_memory(Hashmap *hashmap);
+
+bool hashmap_iterate(Hashmap *hashmap, HashmapIterator *iterator, const char **keyp, void **valuep);
+
+static inline void hashmap_freep(Hashmap **hashmapp) {
+        if (*hashmapp)
+                hashmap_free(*hashmapp);
+}
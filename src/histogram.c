@@ -0,0 +1,75 @@
+#include "histogram.h"
+
+#define SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+/*
+ * Values up to SUB_BUCKETS have a bucket each, above that each power of two is
+ * split in SUB_BUCKETS. Buckets end on a power of two rather than just below
+ * it, so that counts up to a power of two are exact.
+ */
+static unsigned int histogram_bucket(uint64_t value) {
+        unsigned int msb;
+
+        if (value <= SUB_BUCKETS)
+                return value;
+
+        value --;
+        msb = 63 - __builtin_clzll(value);
+
+        return (msb - HISTOGRAM_SUB_BITS + 1) * SUB_BUCKETS +
+               ((value >> (msb - HISTOGRAM_SUB_BITS)) & (SUB_BUCKETS - 1)) + 1;
+}
+
+/* the largest value that falls into @bucket */
+static uint64_t histogram_bucket_max(unsigned int bucket) {
+        unsigned int shift;
+        uint64_t max;
+
+        if (bucket <= SUB_BUCKETS)
+                return bucket;
+
+        bucket --;
+        shift = bucket / SUB_BUCKETS - 1;
+        max = ((uint64_t) (SUB_BUCKETS + bucket % SUB_BUCKETS + 1) << shift) - 1;
+
+        return max < UINT64_MAX ? max + 1 : max;
+}
+
+void histogram_add(Histogram *histogram, uint64_t value) {
+        histogram->buckets[histogram_bucket(value)] ++;
+        histogram->n_values ++;
+        histogram->sum += value;
+        if (value > histogram->max)
+                histogram->max = value;
+}
+
+/* returns an upper bound of the @percent percentile, 0 if the histogram is empty */
+uint64_t histogram_percentile(const Histogram *histogram, unsigned int percent) {
+        uint64_t rank, seen = 0;
+
+        if (histogram->n_values == 0)
+                return 0;
+
+        rank = (histogram->n_values * percent + 99) / 100 ?: 1;
+
+        for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i ++) {
+                seen += histogram->buckets[i];
+                if (seen >= rank) {
+                        uint64_t max = histogram_bucket_max(i);
+
+                        return max < histogram->max ? max : histogram->max;
+                }
+        }
+
+        return histogram->max;
+}
+
+/* the number of values up to and including @limit, exact if @limit is a power of two */
+uint64_t histogram_count_at_most(const Histogram *histogram, uint64_t limit) {
+        uint64_t n = 0;
+
+        for (unsigned int i = 0; i < HISTOGRAM_BUCKETS && histogram_bucket_max(i) <= limit; i ++)
+                n += histogram->buckets[i];
+
+        return n;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * A histogram of latencies with logarithmic buckets: four per power of two,
+ * so a percentile is reported within 25% of the true value, in a fixed 2 KiB.
+ */
+
+#define HISTOGRAM_SUB_BITS (2)
+#define HISTOGRAM_BUCKETS (64 << HISTOGRAM_SUB_BITS)
+
+typedef struct Histogram {
+        uint64_t n_values;
+        uint64_t max;
+        uint64_t sum;
+        uint64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+void histogram_add(Histogram *histogram, uint64_t value);
+uint64_t histogram_percentile(const Histogram *histogram, unsigned int percent);
+uint64_t histogram_count_at_most(const Histogram *histogram, uint64_t limit);
@@ -0,0 +1,374 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hashmap.h"
+#include "index.h"
+#include "time-util.h"
+
+#define INDEX_MAX_DEPTH (16)
+
+typedef struct IndexEntry {
+        unsigned int dir;
+        FirmwareFormat format;
+        char name[];
+} IndexEntry;
+
+struct Index {
+        pthread_rwlock_t lock;
+        Hashmap *entries;
+        /* paths the walk did not enter in any directory: symlinks other than to a file, and deep directories */
+        Hashmap *skipped;
+        size_t memory;
+        uint64_t build_usec;
+};
+
+int index_new(Index **indexp) {
+        Index *index;
+        int r;
+
+        index = calloc(1, sizeof(*index));
+        if (!index)
+                return -ENOMEM;
+
+        r = hashmap_new(&index->entries);
+        if (r < 0) {
+                free(index);
+                return r;
+        }
+
+        r = hashmap_new(&index->skipped);
+        if (r < 0) {
+                hashmap_free(index->entries);
+                free(index);
+                return r;
+        }
+
+        r = pthread_rwlock_init(&index->lock, NULL);
+        if (r > 0) {
+                hashmap_free(index->skipped);
+                hashmap_free(index->entries);
+                free(index);
+                return -r;
+        }
+
+        *indexp = index;
+
+        return 0;
+}
+
+static void index_clear(Index *index) {
+        HashmapIterator i = HASHMAP_ITERATOR_FIRST;
+        IndexEntry *entry;
+        char *path;
+
+        while (hashmap_iterate(index->entries, &i, NULL, (void**) &entry)) {
+                hashmap_remove(index->entries, entry->name);
+                free(entry);
+        }
+
+        i = HASHMAP_ITERATOR_FIRST;
+        while (hashmap_iterate(index->skipped, &i, NULL, (void**) &path)) {
+                hashmap_remove(index->skipped, path);
+                free(path);
+        }
+
+        index->memory = 0;
+        index->build_usec = 0;
+}
+
+void index_free(Index *index) {
+        index_clear(index);
+        hashmap_free(index->skipped);
+        hashmap_free(index->entries);
+        pthread_rwlock_destroy(&index->lock);
+        free(index);
+}
+
+static int index_put(Index *index, const char *name, unsigned int dir, FirmwareFormat format) {
+        IndexEntry *entry;
+        size_t len;
+        int r;
+
+        entry = hashmap_get(index->entries, name);
+        if (entry) {
+                /* an earlier directory wins, within a directory the uncompressed file does */
+                if (dir < entry->dir || (dir == entry->dir && format < entry->format)) {
+                        entry->dir = dir;
+                        entry->format = format;
+                }
+                return 0;
+        }
+
+        len = strlen(name) + 1;
+        entry = malloc(sizeof(*entry) + len);
+        if (!entry)
+                return -ENOMEM;
+
+        entry->dir = dir;
+        entry->format = format;
+        memcpy(entry->name, name, len);
+
+        r = hashmap_put(index->entries, entry->name, entry);
+        if (r < 0) {
+                free(entry);
+                return r;
+        }
+
+        index->memory += sizeof(*entry) + len;
+
+        return 0;
+}
+
+static int index_put_skipped(Index *index, const char *path) {
+        char *copy;
+        int r;
+
+        if (hashmap_get(index->skipped, path))
+                return 0;
+
+        copy = strdup(path);
+        if (!copy)
+                return -ENOMEM;
+
+        r = hashmap_put(index->skipped, copy, copy);
+        if (r < 0) {
+                free(copy);
+                return r;
+        }
+
+        index->memory += strlen(copy) + 1;
+
+        return 0;
+}
+
+/* whether a leading directory of @name was not walked, a copy under it may shadow the indexed one */
+static bool index_under_skipped(Index *index, const char *name) {
+        char path[PATH_MAX];
+        size_t len;
+
+        if (hashmap_size(index->skipped) == 0)
+                return false;
+
+        len = strlen(name);
+        if (len >= sizeof(path))
+                return true;
+        memcpy(path, name, len + 1);
+
+        for (char *p = strchr(path, '/'); p; p = strchr(p + 1, '/')) {
+                bool found;
+
+                *p = '\0';
+                found = hashmap_get(index->skipped, path);
+                *p = '/';
+                if (found)
+                        return true;
+        }
+
+        return false;
+}
+
+static int index_walk(Index *index, int dirfd, char *path, size_t path_len, unsigned int dir,
+                      const char *skip, unsigned int depth) {
+        struct dirent *de;
+        DIR *d;
+        int fd, r = 0;
+
+        fd = openat(dirfd, path_len > 0 ? path : ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (fd < 0)
+                return errno == ENOENT || errno == EACCES ? 0 : -errno;
+
+        d = fdopendir(fd);
+        if (!d) {
+                close(fd);
+                return -errno;
+        }
+
+        while ((de = readdir(d))) {
+                unsigned char type = de->d_type;
+                size_t len;
+
+                if (de->d_name[0] == '.' &&
+                    (de->d_name[1] == '\0' || (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+                        continue;
+
+                /* the per-release subdirectory is a search directory of its own */
+                if (depth == 0 && skip && strcmp(de->d_name, skip) == 0)
+                        continue;
+
+                len = strlen(de->d_name);
+                if (path_len + len + 2 > PATH_MAX)
+                        continue;
+
+                if (path_len > 0)
+                        path[path_len] = '/';
+                memcpy(path + path_len + (path_len > 0), de->d_name, len + 1);
+
+                if (type == DT_UNKNOWN || type == DT_LNK) {
+                        struct stat st;
+
+                        if (fstatat(dirfd, path, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                                type = DT_UNKNOWN;
+                        else if (S_ISLNK(st.st_mode)) {
+                                /* symlinks to files are indexed, names under any other are left to the full lookup */
+                                if (fstatat(dirfd, path, &st, 0) >= 0 && S_ISREG(st.st_mode))
+                                        type = DT_REG;
+                                else {
+                                        type = DT_UNKNOWN;
+                                        r = index_put_skipped(index, path);
+                                }
+                        } else if (S_ISREG(st.st_mode))
+                                type = DT_REG;
+                        else if (S_ISDIR(st.st_mode))
+                                type = DT_DIR;
+                        else
+                                type = DT_UNKNOWN;
+                }
+
+                if (type == DT_REG) {
+                        char name[PATH_MAX];
+                        FirmwareFormat format;
+
+                        memcpy(name, path, path_len + (path_len > 0) + len + 1);
+                        format = firmware_format_strip_suffix(name);
+                        r = index_put(index, name, dir, format);
+                }
+                else if (type == DT_DIR && depth < INDEX_MAX_DEPTH)
+                        r = index_walk(index, dirfd, path, path_len + (path_len > 0) + len, dir, skip, depth + 1);
+                else if (type == DT_DIR)
+                        r = index_put_skipped(index, path);
+
+                path[path_len] = '\0';
+                if (r < 0)
+                        break;
+        }
+
+        closedir(d);
+
+        return r;
+}
+
+int index_add_dir(Index *index, int dirfd, unsigned int dir, const char *path, const char *skip) {
+        char buf[PATH_MAX];
+        uint64_t begin_usec;
+        size_t len;
+        int r;
+
+        if (dirfd < 0)
+                return 0;
+
+        len = strlen(path);
+        if (len >= sizeof(buf))
+                return -ENAMETOOLONG;
+        memcpy(buf, path, len + 1);
+
+        begin_usec = now_usec();
+
+        pthread_rwlock_wrlock(&index->lock);
+        r = index_walk(index, dirfd, buf, len, dir, skip, 0);
+        index->build_usec += now_usec() - begin_usec;
+        pthread_rwlock_unlock(&index->lock);
+
+        return r;
+}
+
+int index_add_link(Index *index, const char *path) {
+        int r;
+
+        pthread_rwlock_wrlock(&index->lock);
+        r = index_put_skipped(index, path);
+        pthread_rwlock_unlock(&index->lock);
+
+        return r;
+}
+
+/* forgets every name, lookups fall back to the full probe until directories are added again */
+void index_reset(Index *index) {
+        pthread_rwlock_wrlock(&index->lock);
+        index_clear(index);
+        pthread_rwlock_unlock(&index->lock);
+}
+
+/*
+ * Moves names found in search directory i to map[i], and forgets those where
+ * that is negative. Copies they shadowed are left to the full lookup, unless
+ * the directories after them are added again.
+ */
+void index_renumber_dirs(Index *index, const int *map, unsigned int n_dirs) {
+        HashmapIterator i = HASHMAP_ITERATOR_FIRST;
+        IndexEntry *entry;
+
+        pthread_rwlock_wrlock(&index->lock);
+
+        while (hashmap_iterate(index->entries, &i, NULL, (void**) &entry)) {
+                if (entry->dir < n_dirs && map[entry->dir] >= 0) {
+                        entry->dir = map[entry->dir];
+                        continue;
+                }
+
+                hashmap_remove(index->entries, entry->name);
+                index->memory -= sizeof(*entry) + strlen(entry->name) + 1;
+                free(entry);
+        }
+
+        pthread_rwlock_unlock(&index->lock);
+}
+
+int index_update(Index *index, unsigned int dir, const char *name, FirmwareFormat format, bool present) {
+        IndexEntry *entry;
+        int r = 0;
+
+        pthread_rwlock_wrlock(&index->lock);
+
+        if (present)
+                r = index_put(index, name, dir, format);
+        else {
+                /* a copy of lower precedence, if any, is left to the full lookup */
+                entry = hashmap_get(index->entries, name);
+                if (entry && entry->dir == dir && entry->format == format) {
+                        hashmap_remove(index->entries, name);
+                        index->memory -= sizeof(*entry) + strlen(entry->name) + 1;
+                        free(entry);
+                }
+        }
+
+        pthread_rwlock_unlock(&index->lock);
+
+        return r;
+}
+
+int index_lookup(Index *index, const char *name, unsigned int *dirp, FirmwareFormat *formatp) {
+        IndexEntry *entry;
+        int r = -ENOENT;
+
+        pthread_rwlock_rdlock(&index->lock);
+
+        entry = hashmap_get(index->entries, name);
+        if (entry && !index_under_skipped(index, name)) {
+                *dirp = entry->dir;
+                *formatp = entry->format;
+                r = 0;
+        }
+
+        pthread_rwlock_unlock(&index->lock);
+
+        return r;
+}
+
+void index_get_stats(Index *index, IndexStats *stats) {
+        pthread_rwlock_rdlock(&index->lock);
+
+        stats->n_entries = hashmap_size(index->entries);
+        stats->memory = index->memory + hashmap_memory(index->entries) + hashmap_memory(index->skipped);
+        stats->build_usec = index->build_usec;
+
+        pthread_rwlock_unlock(&index->lock);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "firmware.h"
+
+/*
+ * An index of the files in all search directories, mapping a firmware name to
+ * the search directory and format that win the lookup. Names are stored
+ * without their compression suffix. Removing a name only forgets it, a copy
+ * of lower precedence is left to be found by the full lookup.
+ *
+ * Symlinks to directories are not followed, nor are directories nested too
+ * deep; names under them are never found in the index, since a copy there
+ * may shadow the indexed one.
+ */
+
+typedef struct Index Index;
+
+typedef struct IndexStats {
+        unsigned int n_entries;
+        size_t memory;
+        uint64_t build_usec;
+} IndexStats;
+
+int index_new(Index **indexp);
+void index_free(Index *index);
+
+int index_add_dir(Index *index, int dirfd, unsigned int dir, const char *path, const char *skip);
+int index_add_link(Index *index, const char *path);
+void index_reset(Index *index);
+void index_renumber_dirs(Index *index, const int *map, unsigned int n_dirs);
+int index_update(Index *index, unsigned int dir, const char *name, FirmwareFormat format, bool present);
+int index_lookup(Index *index, const char *name, unsigned int *dirp, FirmwareFormat *formatp);
+
+void index_get_stats(Index *index, IndexStats *stats);
+
+static inline void index_freep(Index **indexp) {
+        if (*indexp)
+                index_free(*indexp);
+}
@@ -1,250 +1,2675 @@
 #include <errno.h>
 #include <fcntl.h>
-#include <libudev.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/inotify.h>
 #include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 
-#include "firmwared.h"
+#include "cache.h"
+#include "coldplug.h"
 #include "firmware.h"
+#include "hashmap.h"
+#include "histogram.h"
+#include "index.h"
 #include "manager.h"
 #include "log-util.h"
+#include "notify.h"
+#include "queue.h"
+#include "receiver.h"
+#include "server.h"
+#include "time-util.h"
+#include "uevent.h"
+#include "watch.h"
+
+/* events handled per wakeup of the main loop */
+#define MANAGER_MAX_EVENTS (16)
+/* received requests queued per round, before other sources get their turn */
+#define MANAGER_MONITOR_BATCH (64)
+
+/* requests for the same firmware handled by a worker at once, sharing a single read of it */
+#define MANAGER_MAX_FANOUT (64)
+
+/* names with latency histograms of their own, each takes some 12 KiB */
+#define MANAGER_MAX_LATENCY_NAMES (128)
+
+/* the kernel's default, if /sys/class/firmware/timeout cannot be read */
+#define MANAGER_DEFAULT_TIMEOUT_SEC (60)
+
+/* the least time between two status updates sent to the service manager */
+#define MANAGER_STATUS_INTERVAL_USEC (USEC_PER_SEC)
+
+/* names that were not found, each costs a few bytes only */
+#define MANAGER_MAX_MISSES (4096)
+
+/* the phases of a request, each ending where the next one starts */
+typedef enum ManagerPhase {
+        /* received until picked up by a worker */
+        MANAGER_PHASE_QUEUE,
+        /* opening the device and looking up the firmware */
+        MANAGER_PHASE_LOOKUP,
+        /* opening loading and data, until loading is set to 1 */
+        MANAGER_PHASE_OPEN,
+        MANAGER_PHASE_TRANSFER,
+        /* until loading is set to 0 */
+        MANAGER_PHASE_FINISH,
+        /* received until done */
+        MANAGER_PHASE_TOTAL,
+        _MANAGER_PHASE_MAX,
+} ManagerPhase;
+
+static const char * const manager_phase_names[_MANAGER_PHASE_MAX] = {
+        [MANAGER_PHASE_QUEUE] = "queue",
+        [MANAGER_PHASE_LOOKUP] = "lookup",
+        [MANAGER_PHASE_OPEN] = "open",
+        [MANAGER_PHASE_TRANSFER] = "transfer",
+        [MANAGER_PHASE_FINISH] = "finish",
+        [MANAGER_PHASE_TOTAL] = "total",
+};
+
+typedef struct ManagerLatency {
+        char *name;
+        Histogram phases[_MANAGER_PHASE_MAX];
+} ManagerLatency;
+
+typedef struct ManagerPathStats {
+        uint64_t n_calls;
+        uint64_t n_syscalls;
+        uint64_t usec;
+} ManagerPathStats;
 
 struct Manager {
-        struct udev *udev;
-        struct udev_monitor *udev_monitor;
+        UEventMonitor *uevent_monitor;
+        Receiver *receiver;
+        Server *metrics_server;
+        Server *control_server;
+        /*
+         * The search directories in order of precedence, and two fds for each:
+         * itself and its per-release subdirectory. Only the main loop changes
+         * them, the workers hold dirs_lock for reading while they look up
+         * firmware. An fd is replaced atomically when a search directory is
+         * mounted over, the arrays under dirs_lock when directories are added
+         * or removed.
+         */
+        char **dirs;
+        unsigned int n_dirs;
         int *firmwaredirfds;
+        pthread_rwlock_t dirs_lock;
+        /* where the search directories come from, read again on SIGHUP */
+        char *dirs_file;
+        char * const *config_dirs;
+        unsigned int n_config_dirs;
+        /* bumped with every change of the arrays, so a lookup racing with it caches nothing */
+        uint64_t dirs_generation;
+        struct utsname kernel;
+        int mountinfofd;
         int devicesfd;
         int signalfd;
         int epollfd;
+        /* switched at runtime, under pending_lock so that no request is left pending after */
         bool tentative;
+
+        Index *index;
+        /* set once the directories are not watched, the index then misses new copies; read atomically */
+        bool index_disabled;
+        Watch *watch;
+        Cache *cache;
+        uint64_t image_cache_size;
+        /* updated atomically */
+        uint64_t n_decompressions;
+        uint64_t decompress_usec;
+        ManagerPathStats lookup_stats;
+
+        /* names known to be missing, only kept while the search directories are watched */
+        pthread_mutex_t misses_lock;
+        Hashmap *misses;
+        /* bumped whenever a file appears, so a lookup racing with it does not record a miss */
+        uint64_t misses_generation;
+        /* set once a directory could not be watched after startup */
+        bool misses_disabled;
+        uint64_t n_miss_hits;
+
+        /* tentative requests waiting for their firmware to appear, keyed by device, while the directories are watched */
+        pthread_mutex_t pending_lock;
+        Hashmap *pending;
+        uint64_t n_pending_loaded;
+        ManagerPathStats index_lookup_stats;
+        ManagerPathStats uring_upload_stats;
+        ManagerPathStats sync_upload_stats;
+        ManagerPathStats fanout_upload_stats;
+        /* updated atomically */
+        uint64_t n_fanout_groups;
+        uint64_t n_fanout_devices;
+
+        /* request outcomes for the metrics, updated atomically */
+        uint64_t n_received;
+        uint64_t n_loaded;
+        uint64_t n_cancelled;
+        uint64_t n_failed;
+        uint64_t n_lookup_hits;
+        uint64_t n_lookup_misses;
+        uint64_t bytes_transferred;
+
+        Queue queue;
+        bool queue_initialized;
+        const ManagerPriorityClass *priority_classes;
+        unsigned int n_priority_classes;
+        /* how long the kernel waits for an upload, 0 if forever */
+        uint64_t timeout_usec;
+
+        /* requests queued or being handled, keyed by device */
+        pthread_mutex_t inflight_lock;
+        Hashmap *inflight;
+        uint64_t n_coalesced_queued;
+        uint64_t n_coalesced_running;
+        uint64_t n_deferred;
+        uint64_t n_coalesced_coldplug;
+        uint64_t n_superseded;
+        pthread_t *workers;
+        unsigned int n_workers;
+        unsigned int n_workers_running;
+
+        uint64_t start_usec;
+        /* set once, atomically */
+        uint64_t first_upload_usec;
+
+        /* main loop only */
+        uint64_t n_wakeups;
+        uint64_t n_loop_events;
+        unsigned int max_loop_events;
+        uint64_t n_monitor_rounds_full;
+        uint64_t n_resyncs;
+        uint64_t n_resync_requests;
+        uint64_t total_loop_usec;
+        uint64_t max_loop_usec;
+        /* the service manager is notified of readiness and status */
+        bool notify;
+        char notify_status[256];
+        uint64_t notify_usec;
+
+        /* protected by queue.lock */
+        unsigned int n_handled;
+        uint64_t max_completion_usec;
+        uint64_t total_completion_usec;
+        unsigned int n_missed_deadlines;
+        uint64_t max_lateness_usec;
+
+        /* per phase, overall and for each firmware name */
+        pthread_mutex_t latency_lock;
+        ManagerLatency latency;
+        Hashmap *latencies;
+
+        /* requests pending at startup, fed to the workers n_coldplug_jobs at a time; protected by queue.lock */
+        Request *coldplug_head;
+        Request *coldplug_tail;
+        unsigned int n_coldplug_jobs;
+        unsigned int n_coldplug_running;
+        unsigned int n_coldplug;
+        unsigned int n_coldplug_done;
+        unsigned int n_coldplug_failed;
+        uint64_t coldplug_begin_usec;
+        uint64_t coldplug_max_usec;
+        char coldplug_slowest[256];
+        /* the backlog is complete and fed to the workers, and later all of it done */
+        bool coldplug_started;
+        bool coldplug_drained;
 };
 
-int manager_new(Manager **managerp, bool tentative) {
-        _cleanup_(manager_freep) Manager *m = NULL;
-        struct utsname kernel;
-        struct epoll_event ep_udev = { .events = EPOLLIN };
-        struct epoll_event ep_signal = { .events = EPOLLIN };
-        sigset_t mask;
+/* only an index kept current by the watches names the copy of highest precedence */
+static bool manager_use_index(Manager *m) {
+        return m->index && !__atomic_load_n(&m->index_disabled, __ATOMIC_RELAXED);
+}
+
+static void manager_flush_misses_locked(Manager *m) {
+        HashmapIterator i = HASHMAP_ITERATOR_FIRST;
+        char *name;
+
+        while (hashmap_iterate(m->misses, &i, NULL, (void**) &name)) {
+                hashmap_remove(m->misses, name);
+                free(name);
+        }
+}
+
+static void manager_flush_misses(Manager *m) {
+        if (!m->misses)
+                return;
+
+        pthread_mutex_lock(&m->misses_lock);
+        m->misses_generation ++;
+        manager_flush_misses_locked(m);
+        pthread_mutex_unlock(&m->misses_lock);
+}
+
+/* the workers may be using the misses and the index, so they are disabled rather than freed */
+static void manager_watch_failed(Manager *m, int error) {
+        log_warn("could not watch firmware directories, no longer remembering missing firmware or using the index: %s",
+                 strerror(-error));
+
+        __atomic_store_n(&m->index_disabled, true, __ATOMIC_RELAXED);
+        /* a copy that appeared meanwhile may shadow a cached one */
+        cache_remove_dirs(m->cache, 0);
+
+        if (!m->misses)
+                return;
+
+        pthread_mutex_lock(&m->misses_lock);
+        m->misses_disabled = true;
+        manager_flush_misses_locked(m);
+        pthread_mutex_unlock(&m->misses_lock);
+}
+
+static void manager_forget_miss(Manager *m, const char *name) {
+        char *key;
+
+        if (!m->misses)
+                return;
+
+        pthread_mutex_lock(&m->misses_lock);
+        m->misses_generation ++;
+        key = hashmap_remove(m->misses, name);
+        pthread_mutex_unlock(&m->misses_lock);
+
+        free(key);
+}
+
+/* returns true if @name is known to be missing, or the generation to pass to manager_add_miss() */
+static bool manager_is_miss(Manager *m, const char *name, uint64_t *generationp) {
+        bool miss;
+
+        if (!m->misses)
+                return false;
+
+        pthread_mutex_lock(&m->misses_lock);
+        miss = hashmap_get(m->misses, name) != NULL;
+        if (miss)
+                m->n_miss_hits ++;
+        *generationp = m->misses_generation;
+        pthread_mutex_unlock(&m->misses_lock);
+
+        return miss;
+}
+
+static void manager_add_miss(Manager *m, const char *name, uint64_t generation) {
+        char *key;
+
+        if (!m->misses)
+                return;
+
+        key = strdup(name);
+        if (!key)
+                return;
+
+        pthread_mutex_lock(&m->misses_lock);
+        if (generation == m->misses_generation && !m->misses_disabled) {
+                if (hashmap_size(m->misses) >= MANAGER_MAX_MISSES)
+                        manager_flush_misses_locked(m);
+                if (hashmap_put(m->misses, key, key) >= 0)
+                        key = NULL;
+        }
+        pthread_mutex_unlock(&m->misses_lock);
+
+        free(key);
+}
+
+/* the size of the firmware as far as the index knows it, 0 for a firmware that is not found */
+static uint64_t manager_firmware_size(Manager *m, const char *name) {
+        char path[PATH_MAX];
+        FirmwareFormat format;
+        struct stat st;
+        unsigned int dir;
         int r;
 
-        m = calloc(sizeof(*m) + 2 * sizeof(int) * firmware_dirs_size, 1);
-        if (!m)
-                return -ENOMEM;
+        if (!m->index || index_lookup(m->index, name, &dir, &format) < 0)
+                return 0;
 
-        m->tentative = tentative;
-        m->devicesfd = -1;
-        m->signalfd = -1;
-        m->epollfd = -1;
-        m->firmwaredirfds = (int*)(m + 1);
+        r = snprintf(path, sizeof(path), "%s%s", name, firmware_format_suffix(format));
+        if (r < 0 || (size_t) r >= sizeof(path))
+                return 0;
 
-        r = uname(&kernel);
-        if (r < 0)
-                return -errno;
+        if (fstatat(m->firmwaredirfds[dir], path, &st, 0) < 0)
+                return 0;
+
+        return st.st_size;
+}
+
+static int manager_priority(Manager *m, const Request *request) {
+        /* match the DEVPATH, as the kernel reports it */
+        const char *devpath = request->syspath + strlen("/sys");
 
-        for (unsigned int i = 0; i < firmware_dirs_size; i ++) {
-                m->firmwaredirfds[2 * i] = openat(AT_FDCWD, firmware_dirs[i], O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
-                m->firmwaredirfds[2 * i + 1] = openat(m->firmwaredirfds[2 * i], kernel.release, O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+        for (unsigned int i = 0; i < m->n_priority_classes; i ++) {
+                const ManagerPriorityClass *class = &m->priority_classes[i];
+
+                if (fnmatch(class->pattern, class->pattern[0] == '/' ? devpath : request->name, 0) == 0)
+                        return class->priority;
         }
 
-        m->devicesfd = openat(AT_FDCWD, "/sys/devices", O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
-        if (m->devicesfd < 0)
-                return -errno;
+        return 0;
+}
 
-        m->udev = udev_new();
-        if (!m->udev)
-                return -errno;
+/* sets the keys the queue orders requests by, before they are queued */
+static void manager_schedule_request(Manager *m, Request *request) {
+        request->deadline_usec = m->timeout_usec > 0 ? request->received_usec + m->timeout_usec : UINT64_MAX;
 
-        m->udev_monitor = udev_monitor_new_from_netlink(m->udev, "kernel");
-        if (!m->udev_monitor)
-                return -errno;
+        if (m->queue.policy == QUEUE_POLICY_SJF)
+                request->size = manager_firmware_size(m, request->name);
+        else if (m->queue.policy == QUEUE_POLICY_PRIORITY)
+                request->priority = manager_priority(m, request);
+}
 
-        r = udev_monitor_filter_add_match_subsystem_devtype(m->udev_monitor, "firmware", NULL);
-        if (r < 0)
-                return r;
+/*
+ * Hands a request to the workers, unless the device already has one queued or
+ * being handled. A duplicate for the same firmware is dropped and 0 returned
+ * if the older one has not started, or if it was only found again by a
+ * resync; otherwise the kernel asked again after the running upload may have
+ * begun, and the duplicate is queued once it is done. A request for a
+ * different firmware supersedes the older one, which is then skipped if it
+ * has not started yet.
+ */
+static int manager_queue_request(Manager *m, Request *request) {
+        Request *existing;
+        int r;
 
-        sigemptyset(&mask);
-        sigaddset(&mask, SIGTERM);
-        sigaddset(&mask, SIGINT);
-        sigprocmask(SIG_BLOCK, &mask, NULL);
+        __atomic_add_fetch(&m->n_received, 1, __ATOMIC_RELAXED);
 
-        m->signalfd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
-        if (m->signalfd < 0)
-                return -errno;
+        manager_schedule_request(m, request);
 
-        m->epollfd = epoll_create1(EPOLL_CLOEXEC);
-        if (m->epollfd < 0)
-                return -errno;
+        pthread_mutex_lock(&m->inflight_lock);
+        existing = hashmap_get(m->inflight, request->syspath);
+        if (existing) {
+                if (strcmp(existing->name, request->name) == 0) {
+                        if (existing->started && !request->rescanned && !existing->deferred) {
+                                existing->deferred = request;
+                                m->n_deferred ++;
+                                pthread_mutex_unlock(&m->inflight_lock);
+                                return 1;
+                        }
 
-        ep_udev.data.fd = udev_monitor_get_fd(m->udev_monitor);
-        ep_signal.data.fd = m->signalfd;
+                        if (existing->started && !existing->deferred)
+                                m->n_coalesced_running ++;
+                        else
+                                m->n_coalesced_queued ++;
+                        pthread_mutex_unlock(&m->inflight_lock);
+                        request_free(request);
+                        return 0;
+                }
 
-        if (epoll_ctl(m->epollfd, EPOLL_CTL_ADD, udev_monitor_get_fd(m->udev_monitor), &ep_udev) < 0 ||
-            epoll_ctl(m->epollfd, EPOLL_CTL_ADD, m->signalfd, &ep_signal))
-                return -errno;
+                existing->superseded = true;
+                m->n_superseded ++;
+                hashmap_remove(m->inflight, request->syspath);
+        }
+        r = hashmap_put(m->inflight, request->syspath, request);
+        pthread_mutex_unlock(&m->inflight_lock);
+        if (r < 0) {
+                request_free(request);
+                return r;
+        }
 
-        *managerp = m;
-        m = NULL;
+        queue_push(&m->queue, request);
 
-        return 0;
+        return 1;
 }
 
-void manager_free(Manager *m) {
-        if (m->epollfd >= 0)
-                close(m->epollfd);
-        if (m->signalfd >= 0)
-                close(m->signalfd);
-        udev_monitor_unref(m->udev_monitor);
-        udev_unref(m->udev);
-        if (m->devicesfd >= 0)
-                close(m->devicesfd);
-        for (unsigned int i = 0; i < 2 * firmware_dirs_size; i ++)
-                if (m->firmwaredirfds[i] >= 0)
-                        close(m->firmwaredirfds[i]);
-        free(m);
+/* returns false if the request was superseded before a worker got to it */
+static bool manager_request_start(Manager *m, Request *request) {
+        bool start;
+
+        pthread_mutex_lock(&m->inflight_lock);
+        start = !request->superseded;
+        request->started = true;
+        pthread_mutex_unlock(&m->inflight_lock);
+
+        return start;
 }
 
-static int manager_find_firmware(Manager *manager, const char *name) {
-        int firmwarefd;
+static void manager_request_done(Manager *m, Request *request) {
+        Request *deferred;
+        int r = 0;
 
-        for (unsigned int i = 0; i < 2 * firmware_dirs_size; i ++) {
-                firmwarefd = openat(manager->firmwaredirfds[i], name, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
-                if (firmwarefd >= 0)
-                        return firmwarefd;
+        pthread_mutex_lock(&m->inflight_lock);
+        deferred = request->deferred;
+        request->deferred = NULL;
+        if (hashmap_get(m->inflight, request->syspath) == request) {
+                hashmap_remove(m->inflight, request->syspath);
+                if (deferred)
+                        r = hashmap_put(m->inflight, deferred->syspath, deferred);
+        } else if (deferred)
+                /* superseded along with the request it waited for */
+                r = -ESTALE;
+        pthread_mutex_unlock(&m->inflight_lock);
+
+        if (!deferred)
+                return;
+
+        if (r < 0) {
+                if (r != -ESTALE)
+                        log_warn("could not queue firmware request %s: %s", deferred->name, strerror(-r));
+                request_free(deferred);
+                return;
         }
 
-        log_info("firmware '%s' not found", name);
-        return -ENOENT;
+        queue_push(&m->queue, deferred);
 }
 
-static void closep(int *fdp) {
-        if (*fdp >= 0)
-                close(*fdp);
+static bool manager_is_tentative(Manager *m) {
+        return __atomic_load_n(&m->tentative, __ATOMIC_RELAXED);
 }
 
-static int manager_handle_device(Manager *manager, struct udev_device *device) {
-        _cleanup_(closep) int devicefd = -1, firmwarefd = -1;
-        const char *name;
+/* returns false if the request is to be cancelled, because tentative mode was switched off meanwhile */
+static bool manager_add_pending(Manager *m, const char *syspath, const char *name) {
+        Request *request, *old = NULL;
+        bool tentative;
         int r;
 
-        devicefd = openat(manager->devicesfd, udev_device_get_syspath(device), O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
-        if (devicefd < 0)
-                return errno == ENOENT ? 0 : -errno;
+        if (!m->pending)
+                return manager_is_tentative(m);
 
-        name = udev_device_get_property_value(device, "FIRMWARE");
-        firmwarefd = manager_find_firmware(manager, name);
-        if (firmwarefd >= 0) {
-                log_info("load firmware %s", name);
-                r = firmware_load(devicefd, firmwarefd, manager->tentative);
-                if (r < 0)
-                        return r;
-        } else if (!manager->tentative) {
-                log_info("cancel firmware load %s", name);
-                r = firmware_cancel_load(devicefd);
+        r = request_new(&request, syspath, name);
+        if (r < 0)
+                return true;
+
+        pthread_mutex_lock(&m->pending_lock);
+        tentative = m->tentative;
+        if (tentative) {
+                /* a device requests one firmware at a time, a new request replaces the old one */
+                old = hashmap_remove(m->pending, syspath);
+                r = hashmap_put(m->pending, request->syspath, request);
+        }
+        pthread_mutex_unlock(&m->pending_lock);
+
+        if (old)
+                request_free(old);
+        if (!tentative || r < 0) {
+                request_free(request);
+                return tentative;
+        }
+
+        log_info("firmware %s for %s is pending", name, syspath);
+        return true;
+}
+
+/* queues the pending requests for @name, or all of them */
+static void manager_retry_pending(Manager *m, const char *name) {
+        HashmapIterator i = HASHMAP_ITERATOR_FIRST;
+        Request *request;
+        unsigned int n = 0;
+
+        if (!m->pending)
+                return;
+
+        pthread_mutex_lock(&m->pending_lock);
+        while (hashmap_iterate(m->pending, &i, NULL, (void**) &request)) {
+                if (name && strcmp(request->name, name) != 0)
+                        continue;
+
+                hashmap_remove(m->pending, request->syspath);
+                request->received_usec = now_usec();
+                if (manager_queue_request(m, request) > 0)
+                        n ++;
+        }
+        m->n_pending_loaded += n;
+        pthread_mutex_unlock(&m->pending_lock);
+
+        if (n > 0)
+                log_info("retrying %u pending firmware requests for %s", n, name ?: "any firmware");
+}
+
+static void manager_free_pending(Manager *m) {
+        HashmapIterator i = HASHMAP_ITERATOR_FIRST;
+        Request *request;
+
+        while (hashmap_iterate(m->pending, &i, NULL, (void**) &request)) {
+                hashmap_remove(m->pending, request->syspath);
+                request_free(request);
+        }
+
+        hashmap_free(m->pending);
+        pthread_mutex_destroy(&m->pending_lock);
+}
+
+/* once created, the index is kept until the manager is freed: workers use it without a lock of the manager's */
+static int manager_build_index(Manager *m) {
+        const char *release = m->kernel.release;
+        IndexStats stats;
+        int r;
+
+        if (!m->index) {
+                r = index_new(&m->index);
                 if (r < 0)
                         return r;
+        } else
+                index_reset(m->index);
+
+        /* in order of precedence, so that the first directory to provide a name wins */
+        for (unsigned int i = 0; i < 2 * m->n_dirs; i ++) {
+                r = index_add_dir(m->index, m->firmwaredirfds[i], i, "", i % 2 == 0 ? release : NULL);
+                if (r < 0) {
+                        log_warn("could not index firmware directory %s%s%s: %s", m->dirs[i / 2],
+                                 i % 2 == 0 ? "" : "/", i % 2 == 0 ? "" : release, strerror(-r));
+                        /* workers may be looking names up in it, an empty index sends them to the full lookup */
+                        index_reset(m->index);
+                        return 0;
+                }
         }
 
+        index_get_stats(m->index, &stats);
+        log_info("indexed %u firmware files in %llu us, %zu KiB", stats.n_entries,
+                 (unsigned long long) stats.build_usec, stats.memory / 1024);
+
         return 0;
 }
 
-static void udev_enumerate_unrefp(struct udev_enumerate **enumeratep) {
-        if (*enumeratep)
-                udev_enumerate_unref(*enumeratep);
+/* a file appeared once it is complete: written, moved in, or a symlink to it created */
+static bool manager_file_appeared(Manager *m, unsigned int dir, const char *path, uint32_t mask) {
+        struct stat st;
+
+        if (mask & (IN_MOVED_TO|IN_CLOSE_WRITE))
+                return true;
+
+        return (mask & IN_CREATE) &&
+               fstatat(m->firmwaredirfds[dir], path, &st, AT_SYMLINK_NOFOLLOW) >= 0 &&
+               S_ISLNK(st.st_mode);
 }
 
-static void udev_device_unrefp(struct udev_device **devicep) {
-        if (*devicep)
-                udev_device_unref(*devicep);
+/* a symlink to anything but a file hides what is under it from the index */
+static bool manager_link_appeared(Manager *m, unsigned int dir, const char *path, uint32_t mask) {
+        struct stat st;
+
+        if (!(mask & (IN_CREATE|IN_MOVED_TO)) ||
+            fstatat(m->firmwaredirfds[dir], path, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISLNK(st.st_mode))
+                return false;
+
+        return fstatat(m->firmwaredirfds[dir], path, &st, 0) < 0 || !S_ISREG(st.st_mode);
 }
 
-int manager_run(Manager *manager) {
-        _cleanup_(udev_enumerate_unrefp) struct udev_enumerate *enumerate = NULL;
-        struct udev_list_entry *device_list, *device_entry;
+static void manager_watch_event(unsigned int dir, char *path, uint32_t mask, void *userdata) {
+        Manager *m = userdata;
+        FirmwareFormat format;
+        bool appeared;
         int r;
 
-        enumerate = udev_enumerate_new(manager->udev);
-        if (!enumerate)
-                return -errno;
+        if (mask & IN_Q_OVERFLOW) {
+                log_warn("lost inotify events, forgetting cached and missing firmware and indexing again");
+                cache_remove_dirs(m->cache, 0);
+                r = manager_build_index(m);
+                if (r < 0)
+                        log_warn("could not index firmware directories: %s", strerror(-r));
+                manager_flush_misses(m);
+                manager_retry_pending(m, NULL);
+                return;
+        }
 
-        r = udev_enumerate_add_match_subsystem(enumerate, "firmware");
+        if (mask & IN_ISDIR) {
+                if (!(mask & (IN_CREATE|IN_MOVED_TO)))
+                        return;
+
+                if (m->index) {
+                        r = index_add_dir(m->index, m->firmwaredirfds[dir], dir, path, NULL);
+                        if (r < 0)
+                                log_warn("could not index firmware directory %s: %s", path, strerror(-r));
+                }
+
+                manager_flush_misses(m);
+                manager_retry_pending(m, NULL);
+                return;
+        }
+
+        if (m->index && manager_link_appeared(m, dir, path, mask)) {
+                r = index_add_link(m->index, path);
+                if (r < 0)
+                        log_warn("could not index firmware %s: %s", path, strerror(-r));
+        }
+
+        appeared = manager_file_appeared(m, dir, path, mask);
+        format = firmware_format_strip_suffix(path);
+
+        if (m->index) {
+                r = index_update(m->index, dir, path, format, !(mask & (IN_DELETE|IN_MOVED_FROM)));
+                if (r < 0)
+                        log_warn("could not index firmware %s: %s", path, strerror(-r));
+        }
+
+        /* a new copy may shadow the cached one, and a removed one may be shadowed by another */
+        cache_remove(m->cache, path);
+
+        if (mask & (IN_CREATE|IN_MOVED_TO|IN_CLOSE_WRITE))
+                manager_forget_miss(m, path);
+
+        if (appeared)
+                manager_retry_pending(m, path);
+}
+
+static int manager_watch_dirs(Manager *m) {
+        int r;
+
+        r = watch_new(&m->watch, manager_watch_event, m);
         if (r < 0)
                 return r;
 
-        r = udev_monitor_enable_receiving(manager->udev_monitor);
-        if (r < 0)
+        for (unsigned int i = 0; i < 2 * m->n_dirs; i ++) {
+                r = watch_add_dir(m->watch, m->firmwaredirfds[i], i, i % 2 == 0 ? m->kernel.release : NULL);
+                if (r < 0)
+                        return r;
+        }
+
+        r = pthread_mutex_init(&m->misses_lock, NULL);
+        if (r > 0)
+                return -r;
+
+        r = hashmap_new(&m->misses);
+        if (r < 0) {
+                pthread_mutex_destroy(&m->misses_lock);
                 return r;
+        }
 
-        r = udev_enumerate_scan_devices(enumerate);
-        if (r < 0)
+        /* even when not tentative, which may be switched on at runtime */
+        r = pthread_mutex_init(&m->pending_lock, NULL);
+        if (r > 0)
+                return -r;
+
+        r = hashmap_new(&m->pending);
+        if (r < 0) {
+                pthread_mutex_destroy(&m->pending_lock);
                 return r;
+        }
+
+        return 0;
+}
+
+/* drops the misses and pending requests, which rely on the watches, before workers run */
+static void manager_unwatch_dirs(Manager *m) {
+        if (m->pending) {
+                manager_free_pending(m);
+                m->pending = NULL;
+        }
+        if (m->misses) {
+                manager_flush_misses_locked(m);
+                hashmap_free(m->misses);
+                pthread_mutex_destroy(&m->misses_lock);
+                m->misses = NULL;
+        }
+        if (m->watch) {
+                watch_free(m->watch);
+                m->watch = NULL;
+        }
+}
+
+/* opens a search directory and its per-release subdirectory, either of which may be missing */
+static void manager_open_search_dir(Manager *m, const char *path, int *fds) {
+        fds[0] = openat(AT_FDCWD, path, O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+        fds[1] = fds[0] >= 0 ? openat(fds[0], m->kernel.release, O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH) : -1;
+}
+
+static int manager_open_dir(Manager *m, unsigned int dir) {
+        if (dir % 2 == 0)
+                return openat(AT_FDCWD, m->dirs[dir / 2], O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+
+        return openat(m->firmwaredirfds[dir - 1], m->kernel.release, O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+}
+
+/*
+ * Reopens the search directories after the mount table changed. Workers may
+ * be using the old fds, so an existing fd number is replaced in place with
+ * dup3() and a new one is published atomically.
+ */
+static void manager_reopen_dirs(Manager *m) {
+        unsigned int first = UINT_MAX;
+        int r;
 
-        device_list = udev_enumerate_get_list_entry(enumerate);
-        udev_list_entry_foreach(device_entry, device_list) {
-                _cleanup_(udev_device_unrefp) struct udev_device *device = NULL;
+        for (unsigned int i = 0; i < 2 * m->n_dirs; i ++) {
+                struct stat st, old_st;
+                int fd, old = m->firmwaredirfds[i];
 
-                device = udev_device_new_from_syspath(manager->udev, udev_list_entry_get_name(device_entry));
-                if (!device)
+                fd = manager_open_dir(m, i);
+                if (fd < 0)
                         continue;
 
-                r = manager_handle_device(manager, device);
-                if (r < 0)
-                        return r;
+                if (old >= 0 &&
+                    fstat(fd, &st) >= 0 && fstat(old, &old_st) >= 0 &&
+                    st.st_dev == old_st.st_dev && st.st_ino == old_st.st_ino) {
+                        close(fd);
+                        continue;
+                }
+
+                if (old >= 0) {
+                        r = dup3(fd, old, O_CLOEXEC) < 0 ? -errno : 0;
+                        close(fd);
+                        if (r < 0) {
+                                log_warn("could not reopen firmware directory: %s", strerror(-r));
+                                continue;
+                        }
+                } else
+                        __atomic_store_n(&m->firmwaredirfds[i], fd, __ATOMIC_RELEASE);
+
+                log_info("firmware directory %s%s%s changed", m->dirs[i / 2],
+                         i % 2 == 0 ? "" : "/", i % 2 == 0 ? "" : m->kernel.release);
+
+                if (m->watch) {
+                        watch_remove_dir(m->watch, i);
+                        r = watch_add_dir(m->watch, m->firmwaredirfds[i], i, i % 2 == 0 ? m->kernel.release : NULL);
+                        if (r < 0)
+                                manager_watch_failed(m, r);
+                }
+
+                if (first == UINT_MAX)
+                        first = i;
         }
 
-        udev_enumerate_unref(enumerate);
-        enumerate = NULL;
+        if (first == UINT_MAX)
+                return;
 
-        for (;;) {
-                struct epoll_event ev;
-                int n;
+        /* the new directory may shadow firmware found in any directory after it */
+        pthread_rwlock_wrlock(&m->dirs_lock);
+        cache_remove_dirs(m->cache, first);
+        m->dirs_generation ++;
+        pthread_rwlock_unlock(&m->dirs_lock);
 
-                n = epoll_wait(manager->epollfd, &ev, 1, -1);
-                if (n < 0) {
-                        if (errno == EINTR)
-                                continue;
+        r = manager_build_index(m);
+        if (r < 0)
+                log_warn("could not index firmware directories: %s", strerror(-r));
 
-                        return -errno;
-                } else if (n == 0)
+        /* lookups meanwhile went by the old index, and may have cached a copy the new directory shadows */
+        pthread_rwlock_wrlock(&m->dirs_lock);
+        cache_remove_dirs(m->cache, first);
+        m->dirs_generation ++;
+        pthread_rwlock_unlock(&m->dirs_lock);
+
+        manager_flush_misses(m);
+        manager_retry_pending(m, NULL);
+}
+
+static void freep(void *p) {
+        free(*(void**) p);
+}
+
+/*
+ * Replaces the search directories with @paths, in order of precedence. Fds,
+ * watches, cached firmware and index entries of directories in both lists
+ * are kept, under their new numbers. Only called from the main loop.
+ */
+static int manager_set_dirs(Manager *m, char * const *paths, unsigned int n_paths) {
+        _cleanup_(freep) int *map = NULL;
+        _cleanup_(freep) bool *added = NULL;
+        unsigned int first = UINT_MAX, rewalk = UINT_MAX, n_old;
+        char **dirs, **old_dirs;
+        int *fds, *old_fds, last = -1, r;
+        bool ordered = true, removed = false;
+
+        if (n_paths == 0)
+                return -EINVAL;
+
+        /* indexed by the old directory numbers, to the new ones or -1 for a removed directory */
+        map = calloc(2 * m->n_dirs + 1, sizeof(int));
+        added = calloc(n_paths, sizeof(bool));
+        dirs = calloc(n_paths, sizeof(char*));
+        fds = calloc(2 * n_paths, sizeof(int));
+        if (!map || !added || !dirs || !fds)
+                goto fail;
+
+        for (unsigned int j = 0; j < n_paths; j ++) {
+                dirs[j] = strdup(paths[j]);
+                if (!dirs[j])
+                        goto fail;
+        }
+
+        for (unsigned int i = 0; i < 2 * m->n_dirs; i ++)
+                map[i] = -1;
+
+        for (unsigned int j = 0; j < n_paths; j ++) {
+                unsigned int i;
+
+                for (i = 0; i < m->n_dirs; i ++)
+                        if (map[2 * i] < 0 && strcmp(m->dirs[i], paths[j]) == 0)
+                                break;
+
+                if (i == m->n_dirs) {
+                        manager_open_search_dir(m, paths[j], &fds[2 * j]);
+                        added[j] = true;
+                        if (first == UINT_MAX)
+                                first = 2 * j;
                         continue;
+                }
 
-                if (ev.data.fd == manager->signalfd &&
-                    ev.events & EPOLLIN) {
-                        struct signalfd_siginfo fdsi;
-                        ssize_t size;
+                fds[2 * j] = m->firmwaredirfds[2 * i];
+                fds[2 * j + 1] = m->firmwaredirfds[2 * i + 1];
+                map[2 * i] = 2 * j;
+                map[2 * i + 1] = 2 * j + 1;
 
-                        size = read(manager->signalfd, &fdsi, sizeof(fdsi));
-                        if (size != sizeof(fdsi))
-                                continue;
+                /* reordered directories shadow each other differently, nothing cached can be trusted */
+                if ((int) i < last) {
+                        first = 0;
+                        ordered = false;
+                }
+                last = i;
+        }
+
+        /* copies shadowed by a removed directory are found again in the directories after it */
+        for (unsigned int i = 0; i < m->n_dirs && rewalk == UINT_MAX; i ++) {
+                if (map[2 * i] < 0)
+                        removed = true;
+                else if (removed)
+                        rewalk = map[2 * i];
+        }
 
-                        if (fdsi.ssi_signo != SIGTERM && fdsi.ssi_signo != SIGINT)
+        pthread_rwlock_wrlock(&m->dirs_lock);
+
+        /* a new directory may shadow firmware found in any directory after it */
+        cache_renumber_dirs(m->cache, map, 2 * m->n_dirs);
+        if (first != UINT_MAX)
+                cache_remove_dirs(m->cache, first);
+        if (m->index && ordered)
+                index_renumber_dirs(m->index, map, 2 * m->n_dirs);
+        else if (m->index)
+                index_reset(m->index);
+
+        old_dirs = m->dirs;
+        old_fds = m->firmwaredirfds;
+        n_old = m->n_dirs;
+        m->dirs = dirs;
+        m->firmwaredirfds = fds;
+        m->n_dirs = n_paths;
+        m->dirs_generation ++;
+
+        pthread_rwlock_unlock(&m->dirs_lock);
+
+        if (m->watch) {
+                watch_renumber_dirs(m->watch, map, 2 * n_old);
+
+                for (unsigned int i = 0; i < 2 * n_paths; i ++) {
+                        if (!added[i / 2])
                                 continue;
 
-                        return 0;
+                        r = watch_add_dir(m->watch, fds[i], i, i % 2 == 0 ? m->kernel.release : NULL);
+                        if (r < 0) {
+                                manager_watch_failed(m, r);
+                                break;
+                        }
                 }
+        }
 
-                if (ev.data.fd == udev_monitor_get_fd(manager->udev_monitor) &&
-                    ev.events & EPOLLIN) {
-                        for (;;) {
-                                _cleanup_(udev_device_unrefp) struct udev_device *device = NULL;
-
-                                device = udev_monitor_receive_device(manager->udev_monitor);
-                                if (!device)
-                                        break;
+        for (unsigned int i = 0; i < n_old; i ++) {
+                if (map[2 * i] < 0) {
+                        if (old_fds[2 * i] >= 0)
+                                close(old_fds[2 * i]);
+                        if (old_fds[2 * i + 1] >= 0)
+                                close(old_fds[2 * i + 1]);
+                }
+                free(old_dirs[i]);
+        }
+        free(old_dirs);
+        free(old_fds);
 
-                                if (strcmp(udev_device_get_action(device), "add") &&
-                                    strcmp(udev_device_get_action(device), "move"))
-                                        continue;
+        if (!ordered || !m->index) {
+                r = manager_build_index(m);
+                if (r < 0)
+                        log_warn("could not index firmware directories: %s", strerror(-r));
+        } else
+                for (unsigned int i = 0; i < 2 * n_paths; i ++) {
+                        if (!added[i / 2] && i < rewalk)
+                                continue;
 
-                                r = manager_handle_device(manager, device);
-                                if (r < 0)
-                                        return r;
+                        r = index_add_dir(m->index, fds[i], i, "", i % 2 == 0 ? m->kernel.release : NULL);
+                        if (r < 0) {
+                                /* a partial walk may miss a copy shadowing another, the full lookup is always right */
+                                log_warn("could not index firmware directory %s: %s", dirs[i / 2], strerror(-r));
+                                index_reset(m->index);
+                                break;
                         }
                 }
+
+        /* lookups meanwhile went by the old index, and may have cached a copy a new directory shadows */
+        if (first != UINT_MAX) {
+                pthread_rwlock_wrlock(&m->dirs_lock);
+                cache_remove_dirs(m->cache, first);
+                m->dirs_generation ++;
+                pthread_rwlock_unlock(&m->dirs_lock);
+        }
+
+        manager_flush_misses(m);
+        manager_retry_pending(m, NULL);
+
+        return 0;
+
+fail:
+        if (dirs)
+                for (unsigned int j = 0; j < n_paths; j ++)
+                        free(dirs[j]);
+        free(dirs);
+        free(fds);
+        return -ENOMEM;
+}
+
+static void manager_free_dirs(char **dirs, unsigned int n_dirs) {
+        for (unsigned int i = 0; i < n_dirs; i ++)
+                free(dirs[i]);
+        free(dirs);
+}
+
+static int manager_push_dir(char ***dirsp, unsigned int *n_dirsp, const char *path) {
+        char **dirs;
+
+        dirs = realloc(*dirsp, (*n_dirsp + 1) * sizeof(char*));
+        if (!dirs)
+                return -ENOMEM;
+        *dirsp = dirs;
+
+        dirs[*n_dirsp] = strdup(path);
+        if (!dirs[*n_dirsp])
+                return -ENOMEM;
+        (*n_dirsp) ++;
+
+        return 0;
+}
+
+/* the directories listed in dirs_file, one per line, followed by those given at startup */
+static int manager_read_dirs(Manager *m, char ***dirsp, unsigned int *n_dirsp) {
+        _cleanup_(freep) char *line = NULL;
+        char **dirs = NULL;
+        unsigned int n_dirs = 0;
+        size_t size = 0;
+        FILE *f;
+        int r = 0;
+
+        if (m->dirs_file) {
+                f = fopen(m->dirs_file, "re");
+                if (!f)
+                        return -errno;
+
+                while (r >= 0 && getline(&line, &size, f) >= 0) {
+                        char *path = line + strspn(line, " \t");
+                        size_t len = strlen(path);
+
+                        while (len > 0 && strchr(" \t\r\n", path[len - 1]))
+                                path[--len] = '\0';
+                        if (len == 0 || path[0] == '#')
+                                continue;
+
+                        r = manager_push_dir(&dirs, &n_dirs, path);
+                }
+
+                if (r >= 0 && ferror(f))
+                        r = -EIO;
+                fclose(f);
+        }
+
+        for (unsigned int i = 0; r >= 0 && i < m->n_config_dirs; i ++)
+                r = manager_push_dir(&dirs, &n_dirs, m->config_dirs[i]);
+
+        if (r >= 0 && n_dirs == 0)
+                r = -EINVAL;
+        if (r < 0) {
+                manager_free_dirs(dirs, n_dirs);
+                return r;
+        }
+
+        *dirsp = dirs;
+        *n_dirsp = n_dirs;
+
+        return 0;
+}
+
+/* on SIGHUP, a directory still searched keeps its fd, watches, index and cache entries */
+static void manager_reload_dirs(Manager *m) {
+        char **dirs;
+        unsigned int n_dirs;
+        bool changed;
+        int r;
+
+        r = manager_read_dirs(m, &dirs, &n_dirs);
+        if (r < 0) {
+                log_warn("could not reload search directories, keeping them: %s", strerror(-r));
+                return;
+        }
+
+        changed = n_dirs != m->n_dirs;
+        for (unsigned int i = 0; i < n_dirs && !changed; i ++)
+                changed = strcmp(dirs[i], m->dirs[i]) != 0;
+
+        if (!changed)
+                log_info("reloaded search directories, none changed");
+        else {
+                r = manager_set_dirs(m, dirs, n_dirs);
+                if (r < 0)
+                        log_warn("could not change search directories: %s", strerror(-r));
+                else
+                        log_info("reloaded search directories, now searching %u", n_dirs);
+        }
+
+        manager_free_dirs(dirs, n_dirs);
+}
+
+static void manager_add_latency(ManagerLatency *latency, const Request *request, uint64_t done_usec) {
+        const uint64_t times[] = {
+                request->received_usec,
+                request->started_usec,
+                request->found_usec,
+                request->loading_usec,
+                request->transferred_usec,
+                request->finished_usec,
+        };
+
+        /* a request that was not uploaded stops short of the later phases */
+        for (ManagerPhase phase = 0; phase < MANAGER_PHASE_TOTAL && times[phase + 1] > 0; phase ++)
+                histogram_add(&latency->phases[phase], times[phase + 1] - times[phase]);
+
+        histogram_add(&latency->phases[MANAGER_PHASE_TOTAL], done_usec - request->received_usec);
+}
+
+static void manager_record_latency(Manager *manager, const Request *request, uint64_t done_usec) {
+        ManagerLatency *latency;
+
+        pthread_mutex_lock(&manager->latency_lock);
+
+        manager_add_latency(&manager->latency, request, done_usec);
+
+        latency = hashmap_get(manager->latencies, request->name);
+        if (!latency && hashmap_size(manager->latencies) < MANAGER_MAX_LATENCY_NAMES) {
+                latency = calloc(sizeof(*latency) + strlen(request->name) + 1, 1);
+                if (latency) {
+                        latency->name = strcpy((char*) (latency + 1), request->name);
+                        if (hashmap_put(manager->latencies, latency->name, latency) < 0) {
+                                free(latency);
+                                latency = NULL;
+                        }
+                }
+        }
+        if (latency)
+                manager_add_latency(latency, request, done_usec);
+
+        pthread_mutex_unlock(&manager->latency_lock);
+}
+
+/* one line per firmware name, with p50/p90/p99/max of every phase it went through */
+static void manager_log_latency_line(const ManagerLatency *latency) {
+        char line[1024];
+        size_t n;
+
+        n = snprintf(line, sizeof(line), "latency of %s: %llu requests, p50/p90/p99/max us", latency->name,
+                     (unsigned long long) latency->phases[MANAGER_PHASE_TOTAL].n_values);
+
+        for (ManagerPhase phase = 0; phase < _MANAGER_PHASE_MAX && n < sizeof(line); phase ++) {
+                const Histogram *histogram = &latency->phases[phase];
+
+                if (histogram->n_values == 0)
+                        continue;
+
+                n += snprintf(line + n, sizeof(line) - n, " %s %llu/%llu/%llu/%llu", manager_phase_names[phase],
+                              (unsigned long long) histogram_percentile(histogram, 50),
+                              (unsigned long long) histogram_percentile(histogram, 90),
+                              (unsigned long long) histogram_percentile(histogram, 99),
+                              (unsigned long long) histogram->max);
+        }
+
+        log_info("%s", line);
+}
+
+static void manager_log_latency(Manager *manager) {
+        HashmapIterator iterator = HASHMAP_ITERATOR_FIRST;
+        ManagerLatency *latency;
+
+        pthread_mutex_lock(&manager->latency_lock);
+
+        for (ManagerPhase phase = 0; phase < _MANAGER_PHASE_MAX; phase ++) {
+                const Histogram *histogram = &manager->latency.phases[phase];
+
+                if (histogram->n_values == 0)
+                        continue;
+
+                log_info("%s latency: %llu requests, p50 %llu us, p90 %llu us, p99 %llu us, max %llu us",
+                         manager_phase_names[phase], (unsigned long long) histogram->n_values,
+                         (unsigned long long) histogram_percentile(histogram, 50),
+                         (unsigned long long) histogram_percentile(histogram, 90),
+                         (unsigned long long) histogram_percentile(histogram, 99),
+                         (unsigned long long) histogram->max);
+        }
+
+        while (hashmap_iterate(manager->latencies, &iterator, NULL, (void**) &latency))
+                manager_log_latency_line(latency);
+
+        pthread_mutex_unlock(&manager->latency_lock);
+}
+
+static void manager_metric(FILE *f, const char *name, const char *type, const char *help, uint64_t value) {
+        fprintf(f, "# HELP firmwared_%s %s\n# TYPE firmwared_%s %s\nfirmwared_%s %llu\n",
+                name, help, name, type, name, (unsigned long long) value);
+}
+
+/* the overall latency histograms, with buckets at powers of two microseconds from 16 us to 67 s */
+static void manager_metrics_latency(FILE *f, Manager *manager) {
+        fputs("# HELP firmwared_request_phase_seconds Time spent by firmware requests in each phase.\n"
+              "# TYPE firmwared_request_phase_seconds histogram\n", f);
+
+        pthread_mutex_lock(&manager->latency_lock);
+
+        for (ManagerPhase phase = 0; phase < _MANAGER_PHASE_MAX; phase ++) {
+                const Histogram *histogram = &manager->latency.phases[phase];
+
+                for (unsigned int shift = 4; shift <= 26; shift ++)
+                        fprintf(f, "firmwared_request_phase_seconds_bucket{phase=\"%s\",le=\"%.6f\"} %llu\n",
+                                manager_phase_names[phase], (double) (1ULL << shift) / USEC_PER_SEC,
+                                (unsigned long long) histogram_count_at_most(histogram, 1ULL << shift));
+                fprintf(f, "firmwared_request_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n"
+                        "firmwared_request_phase_seconds_sum{phase=\"%s\"} %.6f\n"
+                        "firmwared_request_phase_seconds_count{phase=\"%s\"} %llu\n",
+                        manager_phase_names[phase], (unsigned long long) histogram->n_values,
+                        manager_phase_names[phase], (double) histogram->sum / USEC_PER_SEC,
+                        manager_phase_names[phase], (unsigned long long) histogram->n_values);
+        }
+
+        pthread_mutex_unlock(&manager->latency_lock);
+}
+
+/* a snapshot in Prometheus text format; every lock is held only long enough to copy a few numbers */
+static int manager_metrics(Manager *manager, char **textp, size_t *sizep) {
+        ReceiverStats receiver_stats;
+        CacheStats cache_stats;
+        size_t n_inflight, n_pending = 0;
+        uint64_t n_coalesced, n_deferred, n_miss_hits = 0;
+        unsigned int depth, n_missed;
+        FILE *f;
+
+        cache_get_stats(manager->cache, &cache_stats);
+        receiver_get_stats(manager->receiver, &receiver_stats);
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        n_inflight = hashmap_size(manager->inflight);
+        n_coalesced = manager->n_coalesced_queued + manager->n_coalesced_running + manager->n_coalesced_coldplug;
+        n_deferred = manager->n_deferred;
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        if (manager->misses) {
+                pthread_mutex_lock(&manager->misses_lock);
+                n_miss_hits = manager->n_miss_hits;
+                pthread_mutex_unlock(&manager->misses_lock);
+        }
+
+        if (manager->pending) {
+                pthread_mutex_lock(&manager->pending_lock);
+                n_pending = hashmap_size(manager->pending);
+                pthread_mutex_unlock(&manager->pending_lock);
+        }
+
+        pthread_mutex_lock(&manager->queue.lock);
+        depth = manager->queue.size;
+        n_missed = manager->n_missed_deadlines;
+        pthread_mutex_unlock(&manager->queue.lock);
+
+        f = open_memstream(textp, sizep);
+        if (!f)
+                return -errno;
+
+#define COUNTER(_name) __atomic_load_n(&manager->_name, __ATOMIC_RELAXED)
+        manager_metric(f, "requests_received_total", "counter",
+                       "Firmware requests received, duplicates included.", COUNTER(n_received));
+        manager_metric(f, "requests_loaded_total", "counter",
+                       "Firmware requests answered with an upload.", COUNTER(n_loaded));
+        manager_metric(f, "requests_cancelled_total", "counter",
+                       "Firmware requests cancelled because the firmware was not found.", COUNTER(n_cancelled));
+        manager_metric(f, "requests_failed_total", "counter",
+                       "Firmware requests that failed.", COUNTER(n_failed));
+        manager_metric(f, "requests_coalesced_total", "counter",
+                       "Firmware requests dropped as duplicates of one queued or running.", n_coalesced);
+        manager_metric(f, "requests_deferred_total", "counter",
+                       "Firmware requests queued once a running one for the same device was done.", n_deferred);
+        manager_metric(f, "requests_deadline_missed_total", "counter",
+                       "Firmware requests completed after the kernel stopped waiting.", n_missed);
+        manager_metric(f, "requests_in_flight", "gauge",
+                       "Firmware requests queued or being handled.", n_inflight);
+        manager_metric(f, "requests_pending", "gauge",
+                       "Tentative firmware requests waiting for their firmware to appear.", n_pending);
+        manager_metric(f, "queue_depth", "gauge",
+                       "Firmware requests waiting for a worker.", depth);
+        manager_metric(f, "lookup_hits_total", "counter",
+                       "Firmware lookups that found the firmware.", COUNTER(n_lookup_hits));
+        manager_metric(f, "lookup_misses_total", "counter",
+                       "Firmware lookups that did not find the firmware.", COUNTER(n_lookup_misses));
+        manager_metric(f, "cache_hits_total", "counter",
+                       "Lookups answered by the firmware cache.", cache_stats.n_hits);
+        manager_metric(f, "cache_misses_total", "counter",
+                       "Lookups the firmware cache could not answer.", cache_stats.n_misses);
+        manager_metric(f, "missing_cache_hits_total", "counter",
+                       "Lookups answered by the cache of missing firmware.", n_miss_hits);
+        manager_metric(f, "transferred_bytes_total", "counter",
+                       "Firmware bytes uploaded to devices.", COUNTER(bytes_transferred));
+        manager_metric(f, "uevents_total", "counter",
+                       "Firmware uevents received.", receiver_stats.n_events);
+        manager_metric(f, "uevent_overruns_total", "counter",
+                       "Times the uevent socket overflowed.", receiver_stats.n_overruns);
+        manager_metric(f, "uevents_dropped_total", "counter",
+                       "Firmware uevents dropped because the receive ring was full.", receiver_stats.n_dropped);
+#undef COUNTER
+
+        manager_metrics_latency(f, manager);
+
+        if (fclose(f) != 0) {
+                free(*textp);
+                return -ENOMEM;
+        }
+
+        return 0;
+}
+
+/* answers any GET with the metrics, as an HTTP/1.0 response */
+static int manager_metrics_request(const char *request, size_t size, char **responsep, size_t *sizep, void *userdata) {
+        Manager *manager = userdata;
+        _cleanup_(freep) char *text = NULL;
+        size_t text_size;
+        int r;
+
+        if (size < 4 || memcmp(request, "GET ", 4) != 0) {
+                r = asprintf(responsep, "HTTP/1.0 405 Method Not Allowed\r\nAllow: GET\r\nContent-Length: 0\r\n\r\n");
+                if (r < 0)
+                        return -ENOMEM;
+
+                *sizep = r;
+                return 0;
+        }
+
+        r = manager_metrics(manager, &text, &text_size);
+        if (r < 0)
+                return r;
+
+        r = asprintf(responsep, "HTTP/1.0 200 OK\r\n"
+                     "Content-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\n"
+                     "\r\n"
+                     "%s", text_size, text);
+        if (r < 0)
+                return -ENOMEM;
+
+        *sizep = r;
+        return 0;
+}
+
+static int manager_resync_request(const char *syspath, const char *name, void *userdata) {
+        Manager *manager = userdata;
+        Request *request;
+        int r;
+
+        r = request_new(&request, syspath, name);
+        if (r < 0)
+                return r;
+
+        request->rescanned = true;
+        r = manager_queue_request(manager, request);
+        if (r > 0)
+                manager->n_resync_requests ++;
+
+        return r < 0 ? r : 0;
+}
+
+/* uevents were lost, pick up the requests they carried from sysfs */
+static void manager_resync(Manager *manager) {
+        uint64_t n_requests = manager->n_resync_requests;
+        int r;
+
+        manager->n_resyncs ++;
+
+        r = coldplug_scan(manager_resync_request, manager);
+        if (r < 0) {
+                log_warn("could not rescan firmware requests: %s", strerror(-r));
+                return;
+        }
+
+        log_info("resync: queued %llu of %i pending firmware requests",
+                 (unsigned long long) (manager->n_resync_requests - n_requests), r);
+}
+
+/* switching to final mode cancels the requests left pending, as if their firmware had just not been found */
+static unsigned int manager_set_tentative(Manager *m, bool tentative) {
+        HashmapIterator i = HASHMAP_ITERATOR_FIRST;
+        Request *request, *cancel = NULL;
+        unsigned int n = 0;
+
+        if (m->pending)
+                pthread_mutex_lock(&m->pending_lock);
+        __atomic_store_n(&m->tentative, tentative, __ATOMIC_RELAXED);
+        while (!tentative && m->pending && hashmap_iterate(m->pending, &i, NULL, (void**) &request)) {
+                hashmap_remove(m->pending, request->syspath);
+                request->next = cancel;
+                cancel = request;
+        }
+        if (m->pending)
+                pthread_mutex_unlock(&m->pending_lock);
+
+        log_info("switched to %s mode", tentative ? "tentative" : "final");
+
+        while ((request = cancel)) {
+                int devicefd, r;
+
+                cancel = request->next;
+
+                devicefd = openat(m->devicesfd, request->syspath, O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+                if (devicefd >= 0) {
+                        log_info("cancel firmware load %s", request->name);
+                        r = firmware_cancel_load(devicefd);
+                        if (r < 0)
+                                log_warn("could not cancel firmware load %s for %s: %s", request->name,
+                                         request->syspath, strerror(-r));
+                        else {
+                                __atomic_add_fetch(&m->n_cancelled, 1, __ATOMIC_RELAXED);
+                                n ++;
+                        }
+                        close(devicefd);
+                }
+
+                request_free(request);
+        }
+
+        return n;
+}
+
+static void manager_control_list(Manager *m, FILE *f) {
+        HashmapIterator i = HASHMAP_ITERATOR_FIRST;
+        uint64_t now = now_usec();
+        Request *request;
+
+        if (m->pending) {
+                pthread_mutex_lock(&m->pending_lock);
+                while (hashmap_iterate(m->pending, &i, NULL, (void**) &request))
+                        fprintf(f, "pending %s %s %llu ms\n", request->syspath, request->name,
+                                (unsigned long long) ((now - request->received_usec) / USEC_PER_MSEC));
+                pthread_mutex_unlock(&m->pending_lock);
+        }
+
+        i = HASHMAP_ITERATOR_FIRST;
+        pthread_mutex_lock(&m->inflight_lock);
+        while (hashmap_iterate(m->inflight, &i, NULL, (void**) &request))
+                fprintf(f, "%s %s %s %llu ms\n", request->started ? "running" : "queued", request->syspath,
+                        request->name, (unsigned long long) ((now - request->received_usec) / USEC_PER_MSEC));
+        pthread_mutex_unlock(&m->inflight_lock);
+}
+
+static void manager_control_status(Manager *m, FILE *f) {
+        size_t n_inflight, n_pending = 0;
+        unsigned int depth;
+
+        pthread_mutex_lock(&m->inflight_lock);
+        n_inflight = hashmap_size(m->inflight);
+        pthread_mutex_unlock(&m->inflight_lock);
+
+        if (m->pending) {
+                pthread_mutex_lock(&m->pending_lock);
+                n_pending = hashmap_size(m->pending);
+                pthread_mutex_unlock(&m->pending_lock);
+        }
+
+        pthread_mutex_lock(&m->queue.lock);
+        depth = m->queue.size;
+        pthread_mutex_unlock(&m->queue.lock);
+
+        fprintf(f, "mode %s\nqueued %u\nin-flight %zu\npending %zu\nsearch directories %u\n",
+                manager_is_tentative(m) ? "tentative" : "final", depth, n_inflight, n_pending, m->n_dirs);
+}
+
+/* everything found in the search directories is looked at again, and requests pending in sysfs queued */
+static void manager_rescan(Manager *m, FILE *f) {
+        uint64_t n_requests = m->n_resync_requests;
+        int r;
+
+        cache_remove_dirs(m->cache, 0);
+
+        r = manager_build_index(m);
+        if (r < 0)
+                log_warn("could not index firmware directories: %s", strerror(-r));
+
+        manager_flush_misses(m);
+        manager_retry_pending(m, NULL);
+        manager_resync(m);
+
+        fprintf(f, "queued %llu requests\n", (unsigned long long) (m->n_resync_requests - n_requests));
+}
+
+/* adds @path first or last, or removes it if @add is false */
+static int manager_control_dir(Manager *m, const char *where, const char *path, bool add) {
+        _cleanup_(freep) char **paths = NULL;
+        unsigned int n = 0;
+
+        if (!path || path[0] != '/')
+                return -EINVAL;
+
+        paths = calloc(m->n_dirs + 1, sizeof(char*));
+        if (!paths)
+                return -ENOMEM;
+
+        if (add && strcmp(where, "first") == 0)
+                paths[n++] = (char*) path;
+
+        for (unsigned int i = 0; i < m->n_dirs; i ++)
+                if (strcmp(m->dirs[i], path) != 0)
+                        paths[n++] = m->dirs[i];
+
+        if (add && strcmp(where, "last") == 0)
+                paths[n++] = (char*) path;
+        else if (add && strcmp(where, "first") != 0)
+                return -EINVAL;
+
+        if (!add && n == m->n_dirs)
+                return -ENOENT;
+
+        log_info("%s firmware directory %s", add ? "adding" : "removing", path);
+
+        return manager_set_dirs(m, paths, n);
+}
+
+/*
+ * A command per line: its words are separated by a space, and the last
+ * argument of a command taking a path is the rest of the line.
+ */
+static int manager_control(Manager *m, char *line, FILE *f) {
+        char *command, *arg;
+
+        command = line;
+        arg = strchr(line, ' ');
+        if (arg)
+                *arg++ = '\0';
+
+        if (strcmp(command, "status") == 0 && !arg)
+                manager_control_status(m, f);
+        else if (strcmp(command, "list") == 0 && !arg)
+                manager_control_list(m, f);
+        else if (strcmp(command, "dirs") == 0 && !arg) {
+                for (unsigned int i = 0; i < m->n_dirs; i ++)
+                        fprintf(f, "%s%s\n", m->dirs[i], m->firmwaredirfds[2 * i] < 0 ? " (missing)" : "");
+        } else if (strcmp(command, "rescan") == 0 && !arg)
+                manager_rescan(m, f);
+        else if (strcmp(command, "tentative") == 0 && arg && strcmp(arg, "on") == 0)
+                manager_set_tentative(m, true);
+        else if (strcmp(command, "tentative") == 0 && arg && strcmp(arg, "off") == 0)
+                fprintf(f, "cancelled %u pending requests\n", manager_set_tentative(m, false));
+        else if (strcmp(command, "add-dir") == 0 && arg) {
+                char *path = strchr(arg, ' ');
+
+                if (!path)
+                        return -EINVAL;
+                *path++ = '\0';
+
+                return manager_control_dir(m, arg, path, true);
+        } else if (strcmp(command, "remove-dir") == 0 && arg)
+                return manager_control_dir(m, NULL, arg, false);
+        else
+                return -EINVAL;
+
+        return 0;
+}
+
+/* answers a command with its output, or a line starting with "error:" */
+static int manager_control_request(const char *request, size_t size, char **responsep, size_t *sizep, void *userdata) {
+        Manager *manager = userdata;
+        _cleanup_(freep) char *line = NULL;
+        FILE *f;
+        int r;
+
+        /* without the terminating newline */
+        line = strndup(request, size - 1);
+        if (!line)
+                return -ENOMEM;
+
+        f = open_memstream(responsep, sizep);
+        if (!f)
+                return -errno;
+
+        r = manager_control(manager, line, f);
+        if (r < 0)
+                fprintf(f, "error: %s\n", strerror(-r));
+
+        if (fclose(f) != 0) {
+                free(*responsep);
+                return -ENOMEM;
+        }
+
+        return 0;
+}
+
+/* the seconds the kernel waits for a firmware upload before it gives up on the request */
+static uint64_t manager_read_timeout(void) {
+        unsigned long long timeout;
+        FILE *f;
+        int r;
+
+        f = fopen("/sys/class/firmware/timeout", "re");
+        if (!f)
+                return MANAGER_DEFAULT_TIMEOUT_SEC;
+
+        r = fscanf(f, "%llu", &timeout);
+        fclose(f);
+
+        return r == 1 ? timeout : MANAGER_DEFAULT_TIMEOUT_SEC;
+}
+
+int manager_new(Manager **managerp, const ManagerConfig *config) {
+        _cleanup_(manager_freep) Manager *m = NULL;
+        struct epoll_event ep_uevent = { .events = EPOLLIN };
+        struct epoll_event ep_signal = { .events = EPOLLIN };
+        struct epoll_event ep_watch = { .events = EPOLLIN };
+        struct epoll_event ep_mountinfo = { .events = EPOLLPRI };
+        struct epoll_event ep_metrics = { .events = EPOLLIN };
+        struct epoll_event ep_control = { .events = EPOLLIN };
+        sigset_t mask;
+        int r;
+
+        m = calloc(1, sizeof(*m));
+        if (!m)
+                return -ENOMEM;
+
+        m->start_usec = now_usec();
+        m->tentative = config->tentative;
+        m->n_workers = config->n_workers > 0 ? config->n_workers : 1;
+        m->n_coldplug_jobs = config->n_coldplug_jobs > 0 ? config->n_coldplug_jobs : m->n_workers;
+        m->mountinfofd = -1;
+        m->devicesfd = -1;
+        m->signalfd = -1;
+        m->epollfd = -1;
+        m->dirs_lock = (pthread_rwlock_t) PTHREAD_RWLOCK_INITIALIZER;
+        m->config_dirs = config->dirs;
+        m->n_config_dirs = config->n_dirs;
+
+        if (config->dirs_file) {
+                m->dirs_file = strdup(config->dirs_file);
+                if (!m->dirs_file)
+                        return -ENOMEM;
+        }
+
+        r = manager_read_dirs(m, &m->dirs, &m->n_dirs);
+        if (r < 0) {
+                if (m->dirs_file)
+                        log_error("could not read search directories from %s: %s", m->dirs_file, strerror(-r));
+                return r;
+        }
+
+        m->firmwaredirfds = malloc(2 * m->n_dirs * sizeof(int));
+        if (!m->firmwaredirfds)
+                return -ENOMEM;
+        for (unsigned int i = 0; i < 2 * m->n_dirs; i ++)
+                m->firmwaredirfds[i] = -1;
+
+        m->image_cache_size = config->image_cache_size;
+        m->priority_classes = config->priority_classes;
+        m->n_priority_classes = config->n_priority_classes;
+        m->timeout_usec = manager_read_timeout() * USEC_PER_SEC;
+        m->notify = notify_enabled();
+
+        r = cache_new(&m->cache, config->cache_size, config->image_cache_size);
+        if (r < 0)
+                return r;
+
+        r = queue_init(&m->queue, config->policy);
+        if (r < 0)
+                return r;
+        m->queue_initialized = true;
+
+        r = pthread_mutex_init(&m->inflight_lock, NULL);
+        if (r > 0)
+                return -r;
+
+        r = hashmap_new(&m->inflight);
+        if (r < 0) {
+                pthread_mutex_destroy(&m->inflight_lock);
+                return r;
+        }
+
+        r = pthread_mutex_init(&m->latency_lock, NULL);
+        if (r > 0)
+                return -r;
+
+        r = hashmap_new(&m->latencies);
+        if (r < 0) {
+                pthread_mutex_destroy(&m->latency_lock);
+                return r;
+        }
+
+        m->workers = calloc(m->n_workers, sizeof(pthread_t));
+        if (!m->workers)
+                return -ENOMEM;
+
+        r = uname(&m->kernel);
+        if (r < 0)
+                return -errno;
+
+        for (unsigned int i = 0; i < m->n_dirs; i ++)
+                manager_open_search_dir(m, m->dirs[i], &m->firmwaredirfds[2 * i]);
+
+        r = manager_build_index(m);
+        if (r < 0)
+                return r;
+
+        /* without watching every directory, a miss cannot be remembered */
+        r = manager_watch_dirs(m);
+        if (r < 0) {
+                log_warn("could not watch firmware directories, not using the index: %s", strerror(-r));
+                manager_unwatch_dirs(m);
+                m->index_disabled = true;
+        }
+
+        /* search directories mounted later are picked up when the mount table changes */
+        m->mountinfofd = open("/proc/self/mountinfo", O_RDONLY|O_CLOEXEC);
+        if (m->mountinfofd < 0)
+                log_warn("could not open /proc/self/mountinfo, mounts over firmware directories are not noticed: %m");
+
+        m->devicesfd = openat(AT_FDCWD, "/sys/devices", O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+        if (m->devicesfd < 0)
+                return -errno;
+
+        /* receive before enumerating, so no request falls in between */
+        r = uevent_monitor_new(&m->uevent_monitor);
+        if (r < 0)
+                return r;
+
+        if (config->receive_buffer_size > 0) {
+                r = uevent_monitor_set_receive_buffer(m->uevent_monitor, (int) config->receive_buffer_size);
+                if (r < 0)
+                        log_warn("could not set uevent receive buffer size: %s", strerror(-r));
+        }
+
+        r = receiver_new(&m->receiver, m->uevent_monitor);
+        if (r < 0)
+                return r;
+
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGTERM);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGUSR1);
+        sigaddset(&mask, SIGHUP);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+
+        m->signalfd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+        if (m->signalfd < 0)
+                return -errno;
+
+        m->epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (m->epollfd < 0)
+                return -errno;
+
+        ep_uevent.data.fd = receiver_get_fd(m->receiver);
+        ep_signal.data.fd = m->signalfd;
+
+        if (epoll_ctl(m->epollfd, EPOLL_CTL_ADD, ep_uevent.data.fd, &ep_uevent) < 0 ||
+            epoll_ctl(m->epollfd, EPOLL_CTL_ADD, m->signalfd, &ep_signal))
+                return -errno;
+
+        if (m->watch) {
+                ep_watch.data.fd = watch_get_fd(m->watch);
+                if (epoll_ctl(m->epollfd, EPOLL_CTL_ADD, ep_watch.data.fd, &ep_watch) < 0)
+                        return -errno;
+        }
+
+        if (m->mountinfofd >= 0) {
+                ep_mountinfo.data.fd = m->mountinfofd;
+                if (epoll_ctl(m->epollfd, EPOLL_CTL_ADD, m->mountinfofd, &ep_mountinfo) < 0)
+                        return -errno;
+        }
+
+        if (config->metrics_socket) {
+                r = server_new(&m->metrics_server, config->metrics_socket, 0660, "\r\n\r\n",
+                               manager_metrics_request, m);
+                if (r < 0) {
+                        log_error("could not listen on metrics socket %s: %s", config->metrics_socket, strerror(-r));
+                        return r;
+                }
+
+                ep_metrics.data.fd = server_get_fd(m->metrics_server);
+                if (epoll_ctl(m->epollfd, EPOLL_CTL_ADD, ep_metrics.data.fd, &ep_metrics) < 0)
+                        return -errno;
+        }
+
+        if (config->control_socket) {
+                r = server_new(&m->control_server, config->control_socket, 0600, "\n", manager_control_request, m);
+                if (r < 0) {
+                        log_error("could not listen on control socket %s: %s", config->control_socket, strerror(-r));
+                        return r;
+                }
+
+                ep_control.data.fd = server_get_fd(m->control_server);
+                if (epoll_ctl(m->epollfd, EPOLL_CTL_ADD, ep_control.data.fd, &ep_control) < 0)
+                        return -errno;
+        }
+
+        *managerp = m;
+        m = NULL;
+
+        return 0;
+}
+
+void manager_free(Manager *m) {
+        Request *request;
+
+        while ((request = m->coldplug_head)) {
+                m->coldplug_head = request->next;
+                request_free(request);
+        }
+        if (m->inflight) {
+                /* the entries point into requests freed with the queue or the backlog */
+                hashmap_free(m->inflight);
+                pthread_mutex_destroy(&m->inflight_lock);
+        }
+        if (m->latencies) {
+                HashmapIterator i = HASHMAP_ITERATOR_FIRST;
+                ManagerLatency *latency;
+
+                while (hashmap_iterate(m->latencies, &i, NULL, (void**) &latency))
+                        free(latency);
+                hashmap_free(m->latencies);
+                pthread_mutex_destroy(&m->latency_lock);
+        }
+        if (m->queue_initialized)
+                queue_destroy(&m->queue);
+        free(m->workers);
+        if (m->cache)
+                cache_free(m->cache);
+        if (m->index)
+                index_free(m->index);
+        manager_unwatch_dirs(m);
+        if (m->epollfd >= 0)
+                close(m->epollfd);
+        if (m->signalfd >= 0)
+                close(m->signalfd);
+        if (m->metrics_server)
+                server_free(m->metrics_server);
+        if (m->control_server)
+                server_free(m->control_server);
+        if (m->receiver)
+                receiver_free(m->receiver);
+        if (m->uevent_monitor)
+                uevent_monitor_free(m->uevent_monitor);
+        if (m->devicesfd >= 0)
+                close(m->devicesfd);
+        if (m->mountinfofd >= 0)
+                close(m->mountinfofd);
+        for (unsigned int i = 0; m->firmwaredirfds && i < 2 * m->n_dirs; i ++)
+                if (m->firmwaredirfds[i] >= 0)
+                        close(m->firmwaredirfds[i]);
+        free(m->firmwaredirfds);
+        manager_free_dirs(m->dirs, m->n_dirs);
+        free(m->dirs_file);
+        pthread_rwlock_destroy(&m->dirs_lock);
+        free(m);
+}
+
+static void manager_count(ManagerPathStats *stats, unsigned int n_syscalls, uint64_t usec) {
+        __atomic_add_fetch(&stats->n_calls, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->n_syscalls, n_syscalls, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->usec, usec, __ATOMIC_RELAXED);
+}
+
+static void manager_log_path_stats(const char *what, ManagerPathStats *stats) {
+        if (stats->n_calls == 0)
+                return;
+
+        log_info("%s: %llu calls, %llu syscalls and %llu us on average", what,
+                 (unsigned long long) stats->n_calls,
+                 (unsigned long long) (stats->n_syscalls / stats->n_calls),
+                 (unsigned long long) (stats->usec / stats->n_calls));
+}
+
+/* returns a memfd with the decompressed image, or -1 to stream the compressed firmware instead */
+static int manager_decompress_image(Manager *manager, const char *name, int firmwarefd, FirmwareFormat format) {
+        FirmwareStats stats = {};
+        int memfd, r;
+
+        if (manager->image_cache_size == 0)
+                return -1;
+
+        r = firmware_decompress_image(firmwarefd, format, manager->image_cache_size, &memfd, &stats);
+        if (r < 0) {
+                if (r != -EFBIG)
+                        log_warn("could not decompress firmware '%s%s': %s", name, firmware_format_suffix(format),
+                                 strerror(-r));
+                return -1;
+        }
+
+        __atomic_add_fetch(&manager->n_decompressions, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&manager->decompress_usec, stats.decompress_usec, __ATOMIC_RELAXED);
+
+        log_info("decompressed firmware %s%s: %llu bytes in %llu us CPU", name, firmware_format_suffix(format),
+                 (unsigned long long) stats.size, (unsigned long long) stats.decompress_usec);
+
+        return memfd;
+}
+
+/*
+ * Takes ownership of @firmwarefd, and returns the fd to load the firmware
+ * from. It is only cached if the search directories are still those it was
+ * found in, as of @generation, and nothing was removed from the cache since
+ * @cache_generation.
+ */
+static int manager_add_firmware(Manager *manager, const char *name, unsigned int dir, FirmwareFormat format,
+                                int firmwarefd, uint64_t generation, uint64_t cache_generation,
+                                FirmwareFormat *formatp) {
+        int memfd = -1, r;
+
+        if (format != FIRMWARE_FORMAT_RAW)
+                memfd = manager_decompress_image(manager, name, firmwarefd, format);
+
+        pthread_rwlock_rdlock(&manager->dirs_lock);
+        if (generation == manager->dirs_generation) {
+                r = cache_add(manager->cache, name, dir, format, firmwarefd, memfd, cache_generation);
+                if (r < 0)
+                        log_warn("could not cache firmware '%s': %s", name, strerror(-r));
+        }
+        pthread_rwlock_unlock(&manager->dirs_lock);
+
+        if (memfd >= 0) {
+                close(firmwarefd);
+                *formatp = FIRMWARE_FORMAT_RAW;
+                return memfd;
+        }
+
+        *formatp = format;
+        return firmwarefd;
+}
+
+/* called with dirs_lock held for reading, returns the fd of the first copy of @name and where it was found */
+static int manager_open_firmware(Manager *manager, const char *name, unsigned int *dirp, FirmwareFormat *formatp) {
+        _cleanup_(freep) int *dirfds = NULL;
+        _cleanup_(freep) char **paths = NULL;
+        _cleanup_(freep) unsigned int *dirs = NULL;
+        _cleanup_(freep) FirmwareFormat *formats = NULL;
+        char names[_FIRMWARE_FORMAT_MAX][PATH_MAX];
+        unsigned int n = 0, index, dir, n_syscalls = 0;
+        FirmwareFormat found;
+        uint64_t begin_usec, generation = 0;
+        int firmwarefd, r;
+
+        if (manager_is_miss(manager, name, &generation))
+                return -ENOENT;
+
+        /* a hit in the index takes a single open, anything else falls back to probing every candidate */
+        if (manager_use_index(manager) && index_lookup(manager->index, name, &dir, &found) >= 0) {
+                begin_usec = now_usec();
+                r = snprintf(names[found], sizeof(names[found]), "%s%s", name, firmware_format_suffix(found));
+                if (r < 0 || (size_t) r >= sizeof(names[found]))
+                        return -ENAMETOOLONG;
+
+                firmwarefd = openat(manager->firmwaredirfds[dir], names[found], O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+                manager_count(&manager->index_lookup_stats, 1, now_usec() - begin_usec);
+                if (firmwarefd >= 0) {
+                        *dirp = dir;
+                        *formatp = found;
+                        return firmwarefd;
+                }
+        }
+
+        for (FirmwareFormat format = 0; format < _FIRMWARE_FORMAT_MAX; format ++) {
+                r = snprintf(names[format], sizeof(names[format]), "%s%s", name, firmware_format_suffix(format));
+                if (r < 0 || (size_t) r >= sizeof(names[format]))
+                        return -ENAMETOOLONG;
+        }
+
+        dirfds = calloc(2 * manager->n_dirs * _FIRMWARE_FORMAT_MAX, sizeof(int));
+        paths = calloc(2 * manager->n_dirs * _FIRMWARE_FORMAT_MAX, sizeof(char*));
+        dirs = calloc(2 * manager->n_dirs * _FIRMWARE_FORMAT_MAX, sizeof(unsigned int));
+        formats = calloc(2 * manager->n_dirs * _FIRMWARE_FORMAT_MAX, sizeof(FirmwareFormat));
+        if (!dirfds || !paths || !dirs || !formats)
+                return -ENOMEM;
+
+        /* every candidate in order of precedence: search directory first, then format */
+        for (unsigned int i = 0; i < 2 * manager->n_dirs; i ++) {
+                if (manager->firmwaredirfds[i] < 0)
+                        continue;
+
+                for (FirmwareFormat format = 0; format < _FIRMWARE_FORMAT_MAX; format ++) {
+                        if (!firmware_format_supported(format))
+                                continue;
+
+                        dirfds[n] = manager->firmwaredirfds[i];
+                        paths[n] = names[format];
+                        dirs[n] = i;
+                        formats[n] = format;
+                        n ++;
+                }
+        }
+
+        begin_usec = now_usec();
+        firmwarefd = firmware_open_first(n, dirfds, paths, &index, &n_syscalls);
+        manager_count(&manager->lookup_stats, n_syscalls, now_usec() - begin_usec);
+        if (firmwarefd < 0) {
+                log_info("firmware '%s' not found", name);
+                if (firmwarefd == -ENOENT)
+                        manager_add_miss(manager, name, generation);
+                return firmwarefd;
+        }
+
+        *dirp = dirs[index];
+        *formatp = formats[index];
+        return firmwarefd;
+}
+
+static int manager_find_firmware(Manager *manager, const char *name, FirmwareFormat *formatp) {
+        FirmwareFormat format = FIRMWARE_FORMAT_RAW;
+        uint64_t generation, cache_generation;
+        unsigned int dir = 0;
+        int firmwarefd;
+
+        /* the search directories cannot change during the lookup, but may before the firmware is cached */
+        pthread_rwlock_rdlock(&manager->dirs_lock);
+
+        /* a copy of higher precedence appearing during the lookup removes @name from the cache */
+        cache_generation = cache_get_generation(manager->cache);
+
+        firmwarefd = cache_lookup(manager->cache, manager->firmwaredirfds, name, formatp);
+        if (firmwarefd >= 0) {
+                pthread_rwlock_unlock(&manager->dirs_lock);
+                return firmwarefd;
+        }
+
+        firmwarefd = manager_open_firmware(manager, name, &dir, &format);
+        generation = manager->dirs_generation;
+
+        pthread_rwlock_unlock(&manager->dirs_lock);
+
+        if (firmwarefd < 0)
+                return firmwarefd;
+
+        return manager_add_firmware(manager, name, dir, format, firmwarefd, generation, cache_generation, formatp);
+}
+
+static void closep(int *fdp) {
+        if (*fdp >= 0)
+                close(*fdp);
+}
+
+/* time to the first upload is what the boot waits for */
+static void manager_note_upload(Manager *manager) {
+        uint64_t expected = 0, usec = now_usec() - manager->start_usec;
+
+        if (__atomic_compare_exchange_n(&manager->first_upload_usec, &expected, usec ?: 1, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                log_info("first firmware uploaded %llu ms after startup",
+                         (unsigned long long) (usec / USEC_PER_MSEC));
+}
+
+static void manager_count_upload(Manager *manager, const FirmwareStats *stats, const char *name, unsigned int n_devices) {
+        if (stats->n_syscalls > 0)
+                manager_count(n_devices > 1 ? &manager->fanout_upload_stats :
+                              strcmp(stats->backend, "io_uring") == 0 ? &manager->uring_upload_stats :
+                              &manager->sync_upload_stats,
+                              stats->n_syscalls, stats->usec);
+
+        if (stats->decompress_usec > 0) {
+                __atomic_add_fetch(&manager->n_decompressions, 1, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&manager->decompress_usec, stats->decompress_usec, __ATOMIC_RELAXED);
+        }
+
+        if (stats->size > 0) {
+                char devices[32] = "";
+
+                if (n_devices > 1)
+                        snprintf(devices, sizeof(devices), " to %u devices", n_devices);
+
+                log_info("loaded firmware %s%s: %llu bytes in %llu us (%llu KiB/s, %s)", name, devices,
+                         (unsigned long long) stats->size, (unsigned long long) stats->usec,
+                         (unsigned long long) (stats->size * USEC_PER_SEC / (stats->usec ?: 1) / 1024),
+                         stats->backend);
+                manager_note_upload(manager);
+        }
+}
+
+/* uploads the firmware once for all devices, or falls back to one upload per device */
+static void manager_load_firmware(Manager *manager, const char *name, unsigned int n, const int *devicefds,
+                                  int firmwarefd, FirmwareFormat format, int *results, FirmwareStats *stats) {
+        int r;
+
+        memset(stats, 0, n * sizeof(*stats));
+
+        if (n > 1) {
+                log_info("load firmware %s%s for %u devices", name, firmware_format_suffix(format), n);
+                r = firmware_load_many(n, devicefds, firmwarefd, format, manager_is_tentative(manager), results, &stats[0]);
+                if (r >= 0) {
+                        __atomic_add_fetch(&manager->n_fanout_groups, 1, __ATOMIC_RELAXED);
+                        __atomic_add_fetch(&manager->n_fanout_devices, n, __ATOMIC_RELAXED);
+                        manager_count_upload(manager, &stats[0], name, n);
+                        for (unsigned int i = 1; i < n; i ++)
+                                stats[i] = stats[0];
+                        return;
+                }
+
+                log_info("could not upload firmware %s to %u devices at once (%s), uploading it to each",
+                         name, n, strerror(-r));
+        }
+
+        if (n == 1)
+                log_info("load firmware %s%s", name, firmware_format_suffix(format));
+
+        for (unsigned int i = 0; i < n; i ++) {
+                results[i] = firmware_load(devicefds[i], firmwarefd, format, manager_is_tentative(manager), &stats[i]);
+                if (results[i] >= 0)
+                        manager_count_upload(manager, &stats[i], name, 1);
+        }
+}
+
+/*
+ * Handles the requests of @n devices for the same firmware: it is looked up
+ * once, and read once to feed all of them. The outcome for each request is
+ * returned in @results.
+ */
+static void manager_handle_requests(Manager *manager, Request **requests, unsigned int n, int *results) {
+        _cleanup_(closep) int firmwarefd = -1;
+        const char *name = requests[0]->name;
+        int devicefds[MANAGER_MAX_FANOUT], loaded[MANAGER_MAX_FANOUT];
+        unsigned int slots[MANAGER_MAX_FANOUT], n_devices = 0;
+        FirmwareStats stats[MANAGER_MAX_FANOUT];
+        FirmwareFormat format;
+        uint64_t found_usec;
+        int r;
+
+        for (unsigned int i = 0; i < n; i ++) {
+                int devicefd;
+
+                results[i] = 0;
+                if (!manager_request_start(manager, requests[i]))
+                        continue;
+
+                devicefd = openat(manager->devicesfd, requests[i]->syspath, O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+                if (devicefd < 0) {
+                        if (errno != ENOENT)
+                                results[i] = -errno;
+                        continue;
+                }
+
+                devicefds[n_devices] = devicefd;
+                slots[n_devices++] = i;
+        }
+
+        if (n_devices == 0)
+                return;
+
+        firmwarefd = manager_find_firmware(manager, name, &format);
+        found_usec = now_usec();
+        for (unsigned int i = 0; i < n_devices; i ++)
+                requests[slots[i]]->found_usec = found_usec;
+        __atomic_add_fetch(firmwarefd >= 0 ? &manager->n_lookup_hits : &manager->n_lookup_misses, 1, __ATOMIC_RELAXED);
+
+        if (firmwarefd >= 0) {
+                manager_load_firmware(manager, name, n_devices, devicefds, firmwarefd, format, loaded, stats);
+                for (unsigned int i = 0; i < n_devices; i ++) {
+                        Request *request = requests[slots[i]];
+
+                        results[slots[i]] = loaded[i];
+                        if (loaded[i] >= 0 && stats[i].size > 0) {
+                                __atomic_add_fetch(&manager->n_loaded, 1, __ATOMIC_RELAXED);
+                                __atomic_add_fetch(&manager->bytes_transferred, stats[i].size, __ATOMIC_RELAXED);
+                        }
+                        request->loading_usec = stats[i].loading_usec;
+                        request->transferred_usec = stats[i].transferred_usec;
+                        request->finished_usec = stats[i].finished_usec;
+                }
+        } else {
+                bool logged = false;
+
+                for (unsigned int i = 0; i < n_devices; i ++) {
+                        if (manager_is_tentative(manager) &&
+                            (firmwarefd != -ENOENT || manager_add_pending(manager, requests[slots[i]]->syspath, name)))
+                                continue;
+
+                        if (!logged) {
+                                log_info("cancel firmware load %s", name);
+                                logged = true;
+                        }
+
+                        r = firmware_cancel_load(devicefds[i]);
+                        if (r < 0)
+                                results[slots[i]] = r;
+                        else
+                                __atomic_add_fetch(&manager->n_cancelled, 1, __ATOMIC_RELAXED);
+                }
+        }
+
+        for (unsigned int i = 0; i < n_devices; i ++)
+                close(devicefds[i]);
+}
+
+static int manager_coldplug_request(const char *syspath, const char *name, void *userdata) {
+        Manager *manager = userdata;
+        Request *request;
+        int r;
+
+        r = request_new(&request, syspath, name);
+        if (r < 0)
+                return r;
+
+        __atomic_add_fetch(&manager->n_received, 1, __ATOMIC_RELAXED);
+
+        /* the receiver thread may have delivered a live request for it already */
+        pthread_mutex_lock(&manager->inflight_lock);
+        r = hashmap_put(manager->inflight, request->syspath, request);
+        if (r == -EEXIST)
+                manager->n_coalesced_coldplug ++;
+        pthread_mutex_unlock(&manager->inflight_lock);
+        if (r < 0) {
+                request_free(request);
+                return r == -EEXIST ? 0 : r;
+        }
+
+        /* the workers do not see the backlog before manager_start_coldplug(), which feeds it in policy order */
+        request->coldplug = true;
+        manager_schedule_request(manager, request);
+
+        /* workers handling live requests may take from it already, see manager_coldplug_take_matching() */
+        pthread_mutex_lock(&manager->queue.lock);
+        request_list_insert(manager->queue.policy, &manager->coldplug_head, &manager->coldplug_tail, request);
+        manager->n_coldplug ++;
+        pthread_mutex_unlock(&manager->queue.lock);
+
+        return 0;
+}
+
+/* called with queue.lock held */
+static Request *manager_coldplug_next(Manager *manager) {
+        Request *request = manager->coldplug_head;
+
+        if (!request)
+                return NULL;
+
+        manager->coldplug_head = request->next;
+        if (!manager->coldplug_head)
+                manager->coldplug_tail = NULL;
+        request->next = NULL;
+
+        return request;
+}
+
+/* called with queue.lock held, returns true once: when the whole backlog was fed to the workers and is done */
+static bool manager_coldplug_drained(Manager *manager) {
+        if (!manager->coldplug_started || manager->coldplug_drained || manager->n_coldplug_done < manager->n_coldplug)
+                return false;
+
+        manager->coldplug_drained = true;
+        if (manager->n_coldplug > 0)
+                log_info("coldplug: drained %u firmware requests in %llu ms with %u jobs, %u failed, slowest %s in %llu ms",
+                         manager->n_coldplug,
+                         (unsigned long long) ((now_usec() - manager->coldplug_begin_usec) / USEC_PER_MSEC),
+                         manager->n_coldplug_jobs, manager->n_coldplug_failed, manager->coldplug_slowest,
+                         (unsigned long long) (manager->coldplug_max_usec / USEC_PER_MSEC));
+
+        return true;
+}
+
+/* monitoring is enabled before coldplug, so once its backlog is drained every request is taken care of */
+static void manager_notify_ready(Manager *manager) {
+        int r;
+
+        if (!manager->notify)
+                return;
+
+        r = notify_send("READY=1");
+        if (r < 0)
+                log_warn("could not notify the service manager: %s", strerror(-r));
+}
+
+static void manager_start_coldplug(Manager *manager) {
+        Request *head = NULL, *tail = NULL, *request;
+        bool drained;
+
+        pthread_mutex_lock(&manager->queue.lock);
+        while (manager->n_coldplug_running < manager->n_coldplug_jobs &&
+               (request = manager_coldplug_next(manager))) {
+                if (tail)
+                        tail->next = request;
+                else
+                        head = request;
+                tail = request;
+                manager->n_coldplug_running ++;
+        }
+        /* with nothing pending, or everything taken along with live requests already */
+        manager->coldplug_started = true;
+        drained = manager_coldplug_drained(manager);
+        pthread_mutex_unlock(&manager->queue.lock);
+
+        if (drained)
+                manager_notify_ready(manager);
+
+        while ((request = head)) {
+                head = request->next;
+                queue_push(&manager->queue, request);
+        }
+}
+
+/* takes backlog requests for firmware @name, to be handled along with a running one */
+static unsigned int manager_coldplug_take_matching(Manager *manager, const char *name, Request **requests, unsigned int max) {
+        Request **p, *last = NULL;
+        unsigned int n = 0;
+
+        pthread_mutex_lock(&manager->queue.lock);
+
+        for (p = &manager->coldplug_head; *p && n < max; ) {
+                Request *request = *p;
+
+                if (strcmp(request->name, name) != 0) {
+                        last = request;
+                        p = &request->next;
+                        continue;
+                }
+
+                *p = request->next;
+                request->next = NULL;
+                requests[n++] = request;
+        }
+
+        if (!*p)
+                manager->coldplug_tail = last;
+
+        pthread_mutex_unlock(&manager->queue.lock);
+
+        return n;
+}
+
+/*
+ * Called with queue.lock held, returns the next coldplug request to queue.
+ * Only a request that held one of the n_coldplug_jobs slots passes it on, one
+ * taken from the backlog by manager_coldplug_take_matching() did not.
+ */
+static Request *manager_coldplug_done(Manager *manager, const Request *request, int error, uint64_t completion_usec,
+                                      bool slot) {
+        Request *next = NULL;
+
+        manager->n_coldplug_done ++;
+        if (error < 0)
+                manager->n_coldplug_failed ++;
+        if (completion_usec >= manager->coldplug_max_usec) {
+                manager->coldplug_max_usec = completion_usec;
+                snprintf(manager->coldplug_slowest, sizeof(manager->coldplug_slowest), "%s", request->name);
+        }
+
+        if (slot) {
+                next = manager_coldplug_next(manager);
+                if (!next)
+                        manager->n_coldplug_running --;
+        }
+
+        return next;
+}
+
+static void *manager_worker(void *userdata) {
+        Manager *manager = userdata;
+        Request *requests[MANAGER_MAX_FANOUT];
+        int results[MANAGER_MAX_FANOUT];
+        Request *request;
+        unsigned int depth;
+
+        while ((request = queue_pop(&manager->queue, &depth))) {
+                Request *next_head = NULL, *next_tail = NULL, *next;
+                unsigned int n = 1, n_queued;
+                uint64_t started_usec, done_usec;
+                bool drained;
+
+                /* devices waiting for the same firmware are served by this worker, from a single read */
+                requests[0] = request;
+                n += queue_take_matching(&manager->queue, request->name, requests + n, MANAGER_MAX_FANOUT - n);
+                n_queued = n;
+                n += manager_coldplug_take_matching(manager, request->name, requests + n, MANAGER_MAX_FANOUT - n);
+
+                started_usec = now_usec();
+                for (unsigned int i = 0; i < n; i ++)
+                        requests[i]->started_usec = started_usec;
+
+                manager_handle_requests(manager, requests, n, results);
+                done_usec = now_usec();
+
+                pthread_mutex_lock(&manager->queue.lock);
+                for (unsigned int i = 0; i < n; i ++) {
+                        uint64_t completion_usec = done_usec - requests[i]->received_usec;
+
+                        manager->n_handled ++;
+                        manager->total_completion_usec += completion_usec;
+                        if (completion_usec > manager->max_completion_usec)
+                                manager->max_completion_usec = completion_usec;
+                        if (done_usec > requests[i]->deadline_usec) {
+                                manager->n_missed_deadlines ++;
+                                if (done_usec - requests[i]->deadline_usec > manager->max_lateness_usec)
+                                        manager->max_lateness_usec = done_usec - requests[i]->deadline_usec;
+                        }
+                        if (!requests[i]->coldplug)
+                                continue;
+
+                        next = manager_coldplug_done(manager, requests[i], results[i], completion_usec, i < n_queued);
+                        if (!next)
+                                continue;
+
+                        if (next_tail)
+                                next_tail->next = next;
+                        else
+                                next_head = next;
+                        next_tail = next;
+                }
+                drained = manager_coldplug_drained(manager);
+                pthread_mutex_unlock(&manager->queue.lock);
+
+                if (drained)
+                        manager_notify_ready(manager);
+
+                while ((next = next_head)) {
+                        next_head = next->next;
+                        queue_push(&manager->queue, next);
+                }
+
+                for (unsigned int i = 0; i < n; i ++) {
+                        request = requests[i];
+
+                        if (results[i] < 0) {
+                                __atomic_add_fetch(&manager->n_failed, 1, __ATOMIC_RELAXED);
+                                log_error("failed to handle firmware request %s: %s", request->name, strerror(-results[i]));
+                        }
+
+                        log_info("firmware request %s completed in %llu ms (queued %llu ms, queue depth %u)",
+                                 request->name,
+                                 (unsigned long long) ((done_usec - request->received_usec) / USEC_PER_MSEC),
+                                 (unsigned long long) ((started_usec - request->received_usec) / USEC_PER_MSEC),
+                                 depth);
+                        if (done_usec > request->deadline_usec)
+                                log_warn("firmware request %s missed the kernel's deadline by %llu ms", request->name,
+                                         (unsigned long long) ((done_usec - request->deadline_usec) / USEC_PER_MSEC));
+
+                        manager_record_latency(manager, request, done_usec);
+                        manager_request_done(manager, request);
+                        request_free(request);
+                }
+        }
+
+        return NULL;
+}
+
+static int manager_start_workers(Manager *manager) {
+        int r;
+
+        for (unsigned int i = 0; i < manager->n_workers; i ++) {
+                r = pthread_create(&manager->workers[i], NULL, manager_worker, manager);
+                if (r > 0)
+                        return -r;
+
+                manager->n_workers_running ++;
+        }
+
+        return 0;
+}
+
+static void manager_stop_workers(Manager *manager) {
+        ReceiverStats receiver_stats;
+        CacheStats cache_stats;
+
+        queue_stop(&manager->queue);
+
+        for (unsigned int i = 0; i < manager->n_workers_running; i ++)
+                pthread_join(manager->workers[i], NULL);
+        manager->n_workers_running = 0;
+
+        log_info("handled %u firmware requests with %u workers, max queue depth %u, completion avg %llu ms max %llu ms",
+                 manager->n_handled, manager->n_workers, manager->queue.max_size,
+                 (unsigned long long) (manager->n_handled ? manager->total_completion_usec / manager->n_handled / USEC_PER_MSEC : 0),
+                 (unsigned long long) (manager->max_completion_usec / USEC_PER_MSEC));
+        log_info("%s scheduling: %u of %u firmware requests missed the kernel's %llu s deadline, by up to %llu ms",
+                 queue_policy_to_string(manager->queue.policy), manager->n_missed_deadlines, manager->n_handled,
+                 (unsigned long long) (manager->timeout_usec / USEC_PER_SEC),
+                 (unsigned long long) (manager->max_lateness_usec / USEC_PER_MSEC));
+
+        cache_get_stats(manager->cache, &cache_stats);
+        log_info("firmware cache: %llu hits, %llu misses (%llu%% hit ratio), %llu evictions, %u entries, %llu bytes",
+                 (unsigned long long) cache_stats.n_hits, (unsigned long long) cache_stats.n_misses,
+                 (unsigned long long) (cache_stats.n_hits * 100 / ((cache_stats.n_hits + cache_stats.n_misses) ?: 1)),
+                 (unsigned long long) cache_stats.n_evictions, cache_stats.n_entries,
+                 (unsigned long long) cache_stats.size);
+        if (manager->misses)
+                log_info("missing firmware cache: %llu hits, %zu entries",
+                         (unsigned long long) manager->n_miss_hits, hashmap_size(manager->misses));
+        if (manager->pending && (manager->n_pending_loaded > 0 || hashmap_size(manager->pending) > 0))
+                log_info("pending firmware requests: %llu retried once their firmware appeared, %zu still waiting",
+                         (unsigned long long) manager->n_pending_loaded, hashmap_size(manager->pending));
+        if (manager->n_wakeups > 0)
+                log_info("main loop: %llu wakeups, %llu events per wakeup on average, max %u, %llu us per wakeup on average, max %llu us, %llu request rounds cut short",
+                         (unsigned long long) manager->n_wakeups,
+                         (unsigned long long) (manager->n_loop_events / manager->n_wakeups),
+                         manager->max_loop_events,
+                         (unsigned long long) (manager->total_loop_usec / manager->n_wakeups),
+                         (unsigned long long) manager->max_loop_usec,
+                         (unsigned long long) manager->n_monitor_rounds_full);
+        log_info("coalesced requests: %llu duplicates of queued and %llu of running requests, %llu found again by coldplug, %llu deferred, %llu superseded",
+                 (unsigned long long) manager->n_coalesced_queued, (unsigned long long) manager->n_coalesced_running,
+                 (unsigned long long) manager->n_coalesced_coldplug, (unsigned long long) manager->n_deferred,
+                 (unsigned long long) manager->n_superseded);
+        receiver_get_stats(manager->receiver, &receiver_stats);
+        log_info("uevent receiver: %llu events, ring high-water mark %u of %u, %llu overruns, %llu dropped, %llu resyncs queueing %llu requests",
+                 (unsigned long long) receiver_stats.n_events, receiver_stats.high_water, receiver_stats.capacity,
+                 (unsigned long long) receiver_stats.n_overruns, (unsigned long long) receiver_stats.n_dropped,
+                 (unsigned long long) manager->n_resyncs, (unsigned long long) manager->n_resync_requests);
+        manager_log_latency(manager);
+        manager_log_path_stats("indexed firmware lookup", &manager->index_lookup_stats);
+        manager_log_path_stats("firmware lookup", &manager->lookup_stats);
+        manager_log_path_stats("io_uring upload", &manager->uring_upload_stats);
+        manager_log_path_stats("synchronous upload", &manager->sync_upload_stats);
+        manager_log_path_stats("fan-out upload", &manager->fanout_upload_stats);
+        if (manager->n_fanout_groups > 0)
+                log_info("fan-out uploads: %llu firmware reads served %llu devices",
+                         (unsigned long long) manager->n_fanout_groups, (unsigned long long) manager->n_fanout_devices);
+        log_info("decompressed image cache: %llu hits, %llu decompressions (%llu%% hit ratio), %llu us decompression CPU time, %llu bytes",
+                 (unsigned long long) cache_stats.n_image_hits, (unsigned long long) manager->n_decompressions,
+                 (unsigned long long) (cache_stats.n_image_hits * 100 / ((cache_stats.n_image_hits + manager->n_decompressions) ?: 1)),
+                 (unsigned long long) manager->decompress_usec, (unsigned long long) cache_stats.memory);
+}
+
+static void manager_stop_workersp(Manager **managerp) {
+        if (*managerp)
+                manager_stop_workers(*managerp);
+}
+
+/*
+ * Queues a bounded number of the requests handed over by the receiver thread,
+ * and wakes the loop again for the rest, so other sources get their turn.
+ */
+static int manager_receive_requests(Manager *manager) {
+        uint64_t value;
+        unsigned int n;
+        int r;
+
+        if (read(receiver_get_fd(manager->receiver), &value, sizeof(value)) < 0 && errno != EAGAIN)
+                return -errno;
+
+        r = receiver_get_error(manager->receiver);
+        if (r < 0)
+                return r;
+
+        if (receiver_take_resync(manager->receiver)) {
+                log_warn("uevents were lost");
+                manager_resync(manager);
+        }
+
+        for (n = 0; n < MANAGER_MONITOR_BATCH; n ++) {
+                Request *request;
+
+                request = receiver_pop(manager->receiver);
+                if (!request)
+                        return 0;
+
+                r = manager_queue_request(manager, request);
+                if (r < 0)
+                        return r;
+        }
+
+        manager->n_monitor_rounds_full ++;
+        receiver_wake(manager->receiver);
+
+        return 0;
+}
+
+/*
+ * Sends the service manager a STATUS= line if it changed, at most once per
+ * MANAGER_STATUS_INTERVAL_USEC. Returns how long the main loop may sleep
+ * before the next update, -1 for as long as nothing changes.
+ */
+static int manager_update_status(Manager *manager) {
+        char status[sizeof(manager->notify_status)];
+        unsigned int depth, n_coldplug, n_coldplug_done;
+        size_t n_inflight, n_pending = 0;
+        uint64_t now = now_usec();
+        bool coldplug;
+        int r;
+
+        if (!manager->notify)
+                return -1;
+
+        if (now - manager->notify_usec < MANAGER_STATUS_INTERVAL_USEC)
+                return (manager->notify_usec + MANAGER_STATUS_INTERVAL_USEC - now + USEC_PER_MSEC - 1) / USEC_PER_MSEC;
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        n_inflight = hashmap_size(manager->inflight);
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        if (manager->pending) {
+                pthread_mutex_lock(&manager->pending_lock);
+                n_pending = hashmap_size(manager->pending);
+                pthread_mutex_unlock(&manager->pending_lock);
+        }
+
+        pthread_mutex_lock(&manager->queue.lock);
+        depth = manager->queue.size;
+        coldplug = !manager->coldplug_drained;
+        n_coldplug = manager->n_coldplug;
+        n_coldplug_done = manager->n_coldplug_done;
+        pthread_mutex_unlock(&manager->queue.lock);
+
+        if (coldplug)
+                snprintf(status, sizeof(status), "STATUS=Coldplug: %u of %u requests done, %u queued, %zu in flight",
+                         n_coldplug_done, n_coldplug, depth, n_inflight);
+        else
+                snprintf(status, sizeof(status), "STATUS=%u queued, %zu in flight, %zu pending",
+                         depth, n_inflight, n_pending);
+
+        if (strcmp(status, manager->notify_status) != 0) {
+                r = notify_send(status);
+                if (r < 0)
+                        log_warn("could not notify the service manager: %s", strerror(-r));
+                strcpy(manager->notify_status, status);
+                manager->notify_usec = now;
+        }
+
+        /* the workers change it without waking the main loop, so it is looked at again while there is work */
+        return coldplug || depth > 0 || n_inflight > 0 ? (int) (MANAGER_STATUS_INTERVAL_USEC / USEC_PER_MSEC) : -1;
+}
+
+/* returns 0 to stop the main loop */
+static int manager_dispatch(Manager *manager, const struct epoll_event *ev) {
+        int r;
+
+        if (ev->data.fd == manager->signalfd &&
+            ev->events & EPOLLIN) {
+                struct signalfd_siginfo fdsi;
+                ssize_t size;
+
+                size = read(manager->signalfd, &fdsi, sizeof(fdsi));
+                if (size != sizeof(fdsi))
+                        return 1;
+
+                if (fdsi.ssi_signo == SIGUSR1)
+                        manager_log_latency(manager);
+                else if (fdsi.ssi_signo == SIGHUP)
+                        manager_reload_dirs(manager);
+
+                if (fdsi.ssi_signo != SIGTERM && fdsi.ssi_signo != SIGINT)
+                        return 1;
+
+                if (manager->notify)
+                        notify_send("STOPPING=1");
+
+                return 0;
+        }
+
+        if (ev->data.fd == manager->mountinfofd &&
+            ev->events & EPOLLPRI)
+                manager_reopen_dirs(manager);
+
+        if (manager->watch && ev->data.fd == watch_get_fd(manager->watch) &&
+            ev->events & EPOLLIN) {
+                r = watch_process(manager->watch);
+                if (r < 0)
+                        manager_watch_failed(manager, r);
+        }
+
+        /* only ever answers from memory, and gives up on a client rather than wait for it */
+        if (manager->metrics_server && ev->data.fd == server_get_fd(manager->metrics_server) &&
+            ev->events & EPOLLIN) {
+                r = server_process(manager->metrics_server);
+                if (r < 0)
+                        log_warn("could not serve metrics: %s", strerror(-r));
+        }
+
+        /* commands run on the main loop, so they never race with uevents or watches */
+        if (manager->control_server && ev->data.fd == server_get_fd(manager->control_server) &&
+            ev->events & EPOLLIN) {
+                r = server_process(manager->control_server);
+                if (r < 0)
+                        log_warn("could not serve control commands: %s", strerror(-r));
+        }
+
+        if (ev->data.fd == receiver_get_fd(manager->receiver) &&
+            ev->events & EPOLLIN) {
+                r = manager_receive_requests(manager);
+                if (r < 0)
+                        return r;
+        }
+
+        return 1;
+}
+
+int manager_run(Manager *manager) {
+        _cleanup_(manager_stop_workersp) Manager *workers = NULL;
+        int r;
+
+        r = manager_start_workers(manager);
+        workers = manager;
+        if (r < 0)
+                return r;
+
+        r = receiver_start(manager->receiver);
+        if (r < 0)
+                return r;
+
+        /* failures are isolated per request, and uploads overlap with handling new uevents */
+        manager->coldplug_begin_usec = now_usec();
+        r = coldplug_scan(manager_coldplug_request, manager);
+        if (r < 0)
+                return r;
+
+        log_info("coldplug: found %u pending firmware requests in %llu us", manager->n_coldplug,
+                 (unsigned long long) (now_usec() - manager->coldplug_begin_usec));
+        manager_start_coldplug(manager);
+
+        for (;;) {
+                struct epoll_event events[MANAGER_MAX_EVENTS];
+                uint64_t begin_usec, loop_usec;
+                int n, timeout;
+
+                timeout = manager_update_status(manager);
+
+                n = epoll_wait(manager->epollfd, events, MANAGER_MAX_EVENTS, timeout);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -errno;
+                } else if (n == 0)
+                        continue;
+
+                begin_usec = now_usec();
+
+                for (int i = 0; i < n; i ++) {
+                        r = manager_dispatch(manager, &events[i]);
+                        if (r <= 0)
+                                return r;
+                }
+
+                loop_usec = now_usec() - begin_usec;
+                manager->n_wakeups ++;
+                manager->n_loop_events += n;
+                if ((unsigned int) n > manager->max_loop_events)
+                        manager->max_loop_events = n;
+                manager->total_loop_usec += loop_usec;
+                if (loop_usec > manager->max_loop_usec)
+                        manager->max_loop_usec = loop_usec;
         }
 
         return 0;
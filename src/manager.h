@@ -1,12 +1,48 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "queue.h"
 
 #define _cleanup_(_x) __attribute__((__cleanup__(_x)))
 
+/* upper bound of n_workers and n_coldplug_jobs */
+#define MANAGER_MAX_JOBS (1024)
+
 typedef struct Manager Manager;
 
-int manager_new(Manager **managerp, bool tentative);
+/* requests for a firmware name or, if @pattern starts with a slash, a DEVPATH matching @pattern */
+typedef struct ManagerPriorityClass {
+        const char *pattern;
+        int priority;
+} ManagerPriorityClass;
+
+typedef struct ManagerConfig {
+        /* search directories in order of precedence, must remain valid while the manager runs */
+        char * const *dirs;
+        unsigned int n_dirs;
+        /* more search directories, one per line, searched before @dirs and read again on SIGHUP; NULL for none */
+        const char *dirs_file;
+        bool tentative;
+        unsigned int n_workers;
+        /* requests pending at startup uploaded in parallel, 0 for n_workers */
+        unsigned int n_coldplug_jobs;
+        uint64_t cache_size;
+        uint64_t image_cache_size;
+        /* uevent socket receive buffer in bytes, 0 for the kernel default */
+        uint64_t receive_buffer_size;
+        QueuePolicy policy;
+        /* the first matching class applies, requests matching none are in class 0; must outlive the manager */
+        const ManagerPriorityClass *priority_classes;
+        unsigned int n_priority_classes;
+        /* Unix socket serving metrics in Prometheus text format to the owner and group, NULL for none */
+        const char *metrics_socket;
+        /* Unix socket taking commands from firmwarectl, NULL for none */
+        const char *control_socket;
+} ManagerConfig;
+
+int manager_new(Manager **managerp, const ManagerConfig *config);
 void manager_free(Manager *manager);
 
 int manager_run(Manager *manager);
@@ -0,0 +1,51 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "notify.h"
+
+bool notify_enabled(void) {
+        const char *path = getenv("NOTIFY_SOCKET");
+
+        return path && (path[0] == '/' || path[0] == '@');
+}
+
+int notify_send(const char *state) {
+        struct sockaddr_un address = {
+                .sun_family = AF_UNIX,
+        };
+        const char *path = getenv("NOTIFY_SOCKET");
+        socklen_t address_len;
+        size_t len;
+        ssize_t n;
+        int fd, r = 0;
+
+        if (!notify_enabled())
+                return 0;
+
+        len = strlen(path);
+        if (len > sizeof(address.sun_path) || (path[0] == '/' && len == sizeof(address.sun_path)))
+                return -ENAMETOOLONG;
+
+        /* an abstract name is not terminated, and its leading '@' stands for a nul byte */
+        memcpy(address.sun_path, path, len);
+        if (path[0] == '@')
+                address.sun_path[0] = '\0';
+        address_len = offsetof(struct sockaddr_un, sun_path) + len + (path[0] == '/');
+
+        fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+        if (fd < 0)
+                return -errno;
+
+        n = sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr*) &address, address_len);
+        if (n < 0)
+                r = -errno;
+
+        close(fd);
+
+        return r;
+}
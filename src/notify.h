@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+ * The service manager notification protocol: newline separated assignments
+ * like READY=1 or STATUS=..., sent as a single datagram to the Unix socket
+ * named in $NOTIFY_SOCKET. A name starting with '@' is in the abstract
+ * namespace.
+ */
+
+bool notify_enabled(void);
+/* returns 0 without sending anything if $NOTIFY_SOCKET is not set */
+int notify_send(const char *state);
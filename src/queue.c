@@ -0,0 +1,193 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+#include "time-util.h"
+
+int request_new(Request **requestp, const char *syspath, const char *name) {
+        Request *request;
+        size_t syspath_len, name_len;
+
+        syspath_len = strlen(syspath) + 1;
+        name_len = strlen(name) + 1;
+
+        request = calloc(sizeof(*request) + syspath_len + name_len, 1);
+        if (!request)
+                return -ENOMEM;
+
+        request->syspath = (char*)(request + 1);
+        request->name = request->syspath + syspath_len;
+        memcpy(request->syspath, syspath, syspath_len);
+        memcpy(request->name, name, name_len);
+        request->received_usec = now_usec();
+
+        *requestp = request;
+
+        return 0;
+}
+
+void request_free(Request *request) {
+        if (request->deferred)
+                request_free(request->deferred);
+        free(request);
+}
+
+static const char * const queue_policy_names[_QUEUE_POLICY_MAX] = {
+        [QUEUE_POLICY_FIFO] = "fifo",
+        [QUEUE_POLICY_EDF] = "edf",
+        [QUEUE_POLICY_SJF] = "sjf",
+        [QUEUE_POLICY_PRIORITY] = "priority",
+};
+
+const char *queue_policy_to_string(QueuePolicy policy) {
+        return queue_policy_names[policy];
+}
+
+int queue_policy_from_string(const char *name, QueuePolicy *policyp) {
+        for (QueuePolicy policy = 0; policy < _QUEUE_POLICY_MAX; policy ++)
+                if (strcmp(queue_policy_names[policy], name) == 0) {
+                        *policyp = policy;
+                        return 0;
+                }
+
+        return -EINVAL;
+}
+
+/* whether @a is to be served before @b; ties keep the arrival order */
+static bool request_before(QueuePolicy policy, const Request *a, const Request *b) {
+        switch (policy) {
+        case QUEUE_POLICY_EDF:
+                return a->deadline_usec < b->deadline_usec;
+        case QUEUE_POLICY_SJF:
+                return a->size < b->size;
+        case QUEUE_POLICY_PRIORITY:
+                return a->priority > b->priority;
+        default:
+                return false;
+        }
+}
+
+/* inserts @request after every request to be served before or along with it */
+void request_list_insert(QueuePolicy policy, Request **headp, Request **tailp, Request *request) {
+        Request **p = headp;
+
+        /* most requests arrive in the order of the policy, and all of them under FIFO */
+        if (*tailp && !request_before(policy, request, *tailp))
+                p = &(*tailp)->next;
+        else
+                while (*p && !request_before(policy, request, *p))
+                        p = &(*p)->next;
+
+        request->next = *p;
+        *p = request;
+        if (!request->next)
+                *tailp = request;
+}
+
+int queue_init(Queue *queue, QueuePolicy policy) {
+        int r;
+
+        memset(queue, 0, sizeof(*queue));
+        queue->policy = policy;
+
+        r = pthread_mutex_init(&queue->lock, NULL);
+        if (r > 0)
+                return -r;
+
+        r = pthread_cond_init(&queue->cond, NULL);
+        if (r > 0) {
+                pthread_mutex_destroy(&queue->lock);
+                return -r;
+        }
+
+        return 0;
+}
+
+void queue_destroy(Queue *queue) {
+        while (queue->head) {
+                Request *request = queue->head;
+
+                queue->head = request->next;
+                request_free(request);
+        }
+
+        pthread_cond_destroy(&queue->cond);
+        pthread_mutex_destroy(&queue->lock);
+}
+
+void queue_push(Queue *queue, Request *request) {
+        pthread_mutex_lock(&queue->lock);
+
+        request_list_insert(queue->policy, &queue->head, &queue->tail, request);
+
+        queue->size ++;
+        if (queue->size > queue->max_size)
+                queue->max_size = queue->size;
+
+        pthread_cond_signal(&queue->cond);
+        pthread_mutex_unlock(&queue->lock);
+}
+
+/* blocks until a request is available; returns NULL once the queue is stopped */
+Request *queue_pop(Queue *queue, unsigned int *sizep) {
+        Request *request = NULL;
+
+        pthread_mutex_lock(&queue->lock);
+
+        while (!queue->head && !queue->stopped)
+                pthread_cond_wait(&queue->cond, &queue->lock);
+
+        if (!queue->stopped) {
+                request = queue->head;
+                queue->head = request->next;
+                if (!queue->head)
+                        queue->tail = NULL;
+
+                if (sizep)
+                        *sizep = queue->size;
+                queue->size --;
+        }
+
+        pthread_mutex_unlock(&queue->lock);
+
+        return request;
+}
+
+/* removes up to @max queued requests for firmware @name, in queue order, and returns how many */
+unsigned int queue_take_matching(Queue *queue, const char *name, Request **requests, unsigned int max) {
+        Request **p, *last = NULL;
+        unsigned int n = 0;
+
+        pthread_mutex_lock(&queue->lock);
+
+        for (p = &queue->head; *p && n < max; ) {
+                Request *request = *p;
+
+                if (strcmp(request->name, name) != 0) {
+                        last = request;
+                        p = &request->next;
+                        continue;
+                }
+
+                *p = request->next;
+                request->next = NULL;
+                requests[n++] = request;
+                queue->size --;
+        }
+
+        /* the tail can only have been taken if the whole queue was walked */
+        if (!*p)
+                queue->tail = last;
+
+        pthread_mutex_unlock(&queue->lock);
+
+        return n;
+}
+
+void queue_stop(Queue *queue) {
+        pthread_mutex_lock(&queue->lock);
+        queue->stopped = true;
+        pthread_cond_broadcast(&queue->cond);
+        pthread_mutex_unlock(&queue->lock);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct Request Request;
+
+/* the order in which queued requests are handed to the workers */
+typedef enum QueuePolicy {
+        QUEUE_POLICY_FIFO,
+        /* earliest deadline first */
+        QUEUE_POLICY_EDF,
+        /* shortest job first, by firmware size */
+        QUEUE_POLICY_SJF,
+        /* highest priority class first, then in arrival order */
+        QUEUE_POLICY_PRIORITY,
+        _QUEUE_POLICY_MAX,
+} QueuePolicy;
+
+struct Request {
+        Request *next;
+        char *syspath;
+        char *name;
+        uint64_t received_usec;
+        /* scheduling keys, set before the request is queued */
+        uint64_t deadline_usec;
+        uint64_t size;
+        int priority;
+        /* set by the worker handling it: picked up, firmware found, loading set to 1, transferred, loading set to 0 */
+        uint64_t started_usec;
+        uint64_t found_usec;
+        uint64_t loading_usec;
+        uint64_t transferred_usec;
+        uint64_t finished_usec;
+        /* found pending at startup */
+        bool coldplug;
+        /* found pending by a resync, while a request for it may be running */
+        bool rescanned;
+        /* protected by the manager's in-flight lock */
+        bool started;
+        bool superseded;
+        /* the same firmware requested again while this one was running, queued once it is done */
+        Request *deferred;
+};
+
+int request_new(Request **requestp, const char *syspath, const char *name);
+void request_free(Request *request);
+
+const char *queue_policy_to_string(QueuePolicy policy);
+int queue_policy_from_string(const char *name, QueuePolicy *policyp);
+void request_list_insert(QueuePolicy policy, Request **headp, Request **tailp, Request *request);
+
+typedef struct Queue {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        Request *head;
+        Request *tail;
+        unsigned int size;
+        unsigned int max_size;
+        QueuePolicy policy;
+        bool stopped;
+} Queue;
+
+int queue_init(Queue *queue, QueuePolicy policy);
+void queue_destroy(Queue *queue);
+
+void queue_push(Queue *queue, Request *request);
+Request *queue_pop(Queue *queue, unsigned int *sizep);
+unsigned int queue_take_matching(Queue *queue, const char *name, Request **requests, unsigned int max);
+void queue_stop(Queue *queue);
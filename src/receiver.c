@@ -0,0 +1,267 @@
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "log-util.h"
+#include "receiver.h"
+
+/* a power of two, large enough for any realistic storm of firmware requests */
+#define RECEIVER_RING_SIZE (4096)
+
+struct Receiver {
+        UEventMonitor *monitor;
+        int eventfd;
+        int stopfd;
+        pthread_t thread;
+        bool started;
+
+        /* written by the receiver thread only */
+        uint64_t head;
+        /* written by the consumer only */
+        uint64_t tail;
+        Request *ring[RECEIVER_RING_SIZE];
+
+        /* updated atomically */
+        bool resync;
+        /* set when the thread gave up */
+        int error;
+        uint64_t n_events;
+        uint64_t n_overruns;
+        uint64_t n_dropped;
+        unsigned int high_water;
+};
+
+int receiver_new(Receiver **receiverp, UEventMonitor *monitor) {
+        Receiver *receiver;
+        int r;
+
+        receiver = calloc(1, sizeof(*receiver));
+        if (!receiver)
+                return -ENOMEM;
+
+        receiver->monitor = monitor;
+        receiver->stopfd = -1;
+
+        receiver->eventfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        if (receiver->eventfd < 0)
+                goto fail;
+
+        receiver->stopfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        if (receiver->stopfd < 0)
+                goto fail;
+
+        *receiverp = receiver;
+
+        return 0;
+
+fail:
+        r = -errno;
+        if (receiver->eventfd >= 0)
+                close(receiver->eventfd);
+        free(receiver);
+        return r;
+}
+
+void receiver_free(Receiver *receiver) {
+        Request *request;
+
+        if (receiver->started) {
+                uint64_t one = 1;
+
+                if (write(receiver->stopfd, &one, sizeof(one)) == sizeof(one))
+                        pthread_join(receiver->thread, NULL);
+        }
+
+        while ((request = receiver_pop(receiver)))
+                request_free(request);
+
+        close(receiver->stopfd);
+        close(receiver->eventfd);
+        free(receiver);
+}
+
+void receiver_wake(Receiver *receiver) {
+        uint64_t one = 1;
+
+        if (write(receiver->eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                log_warn("could not wake uevent consumer: %s", strerror(errno));
+}
+
+static bool receiver_push(Receiver *receiver, Request *request) {
+        uint64_t head = receiver->head;
+        uint64_t tail = __atomic_load_n(&receiver->tail, __ATOMIC_ACQUIRE);
+        unsigned int depth = (unsigned int) (head - tail);
+
+        if (depth >= RECEIVER_RING_SIZE)
+                return false;
+
+        receiver->ring[head % RECEIVER_RING_SIZE] = request;
+        __atomic_store_n(&receiver->head, head + 1, __ATOMIC_RELEASE);
+
+        if (depth + 1 > __atomic_load_n(&receiver->high_water, __ATOMIC_RELAXED))
+                __atomic_store_n(&receiver->high_water, depth + 1, __ATOMIC_RELAXED);
+
+        return true;
+}
+
+Request *receiver_pop(Receiver *receiver) {
+        uint64_t tail = receiver->tail;
+        Request *request;
+
+        if (tail == __atomic_load_n(&receiver->head, __ATOMIC_ACQUIRE))
+                return NULL;
+
+        request = receiver->ring[tail % RECEIVER_RING_SIZE];
+        __atomic_store_n(&receiver->tail, tail + 1, __ATOMIC_RELEASE);
+
+        return request;
+}
+
+/* returns the error the receiver thread stopped on, 0 while it runs */
+int receiver_get_error(Receiver *receiver) {
+        return __atomic_load_n(&receiver->error, __ATOMIC_ACQUIRE);
+}
+
+/* returns true once after events were lost, the consumer must then rescan */
+bool receiver_take_resync(Receiver *receiver) {
+        return __atomic_exchange_n(&receiver->resync, false, __ATOMIC_ACQ_REL);
+}
+
+static void receiver_lost(Receiver *receiver) {
+        __atomic_store_n(&receiver->resync, true, __ATOMIC_RELEASE);
+        receiver_wake(receiver);
+}
+
+static Request *receiver_request(const UEvent *event) {
+        char syspath[PATH_MAX];
+        Request *request;
+        int r;
+
+        /* the socket filter lets events with very long devpaths through */
+        if (strcmp(event->subsystem, "firmware") ||
+            (strcmp(event->action, "add") && strcmp(event->action, "move")) ||
+            !event->firmware)
+                return NULL;
+
+        r = snprintf(syspath, sizeof(syspath), "/sys%s", event->devpath);
+        if (r < 0 || (size_t) r >= sizeof(syspath))
+                return NULL;
+
+        if (request_new(&request, syspath, event->firmware) < 0)
+                return NULL;
+
+        return request;
+}
+
+static void *receiver_thread(void *userdata) {
+        Receiver *receiver = userdata;
+        struct pollfd pollfds[2] = {
+                { .fd = uevent_monitor_get_fd(receiver->monitor), .events = POLLIN },
+                { .fd = receiver->stopfd, .events = POLLIN },
+        };
+
+        for (;;) {
+                unsigned int n = 0;
+                int r;
+
+                if (poll(pollfds, 2, -1) < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        /* without the thread no request arrives, the consumer is woken to stop */
+                        r = -errno;
+                        log_error("could not wait for uevents: %s", strerror(-r));
+                        __atomic_store_n(&receiver->error, r, __ATOMIC_RELEASE);
+                        receiver_wake(receiver);
+                        return NULL;
+                }
+
+                if (pollfds[1].revents)
+                        return NULL;
+
+                for (;;) {
+                        Request *request;
+                        UEvent event;
+
+                        r = uevent_monitor_receive(receiver->monitor, &event);
+                        if (r == -ENOBUFS) {
+                                __atomic_add_fetch(&receiver->n_overruns, 1, __ATOMIC_RELAXED);
+                                receiver_lost(receiver);
+                                continue;
+                        }
+                        if (r < 0) {
+                                log_error("could not receive uevent: %s", strerror(-r));
+                                break;
+                        }
+                        if (r == 0)
+                                break;
+
+                        __atomic_add_fetch(&receiver->n_events, 1, __ATOMIC_RELAXED);
+
+                        request = receiver_request(&event);
+                        if (!request)
+                                continue;
+
+                        if (!receiver_push(receiver, request)) {
+                                /* never block the socket, a full ring is recovered like an overrun */
+                                request_free(request);
+                                __atomic_add_fetch(&receiver->n_dropped, 1, __ATOMIC_RELAXED);
+                                receiver_lost(receiver);
+                                continue;
+                        }
+
+                        n ++;
+                }
+
+                if (n > 0)
+                        receiver_wake(receiver);
+        }
+}
+
+int receiver_start(Receiver *receiver) {
+        struct sched_param param = { .sched_priority = 1 };
+        pthread_attr_t attr;
+        int r;
+
+        r = pthread_attr_init(&attr);
+        if (r > 0)
+                return -r;
+
+        /* a realtime priority needs privileges, without them the thread runs as normal */
+        if (pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED) == 0 &&
+            pthread_attr_setschedpolicy(&attr, SCHED_FIFO) == 0 &&
+            pthread_attr_setschedparam(&attr, &param) == 0)
+                r = pthread_create(&receiver->thread, &attr, receiver_thread, receiver);
+        else
+                r = EPERM;
+
+        if (r == EPERM)
+                r = pthread_create(&receiver->thread, NULL, receiver_thread, receiver);
+
+        pthread_attr_destroy(&attr);
+        if (r > 0)
+                return -r;
+
+        receiver->started = true;
+
+        return 0;
+}
+
+int receiver_get_fd(Receiver *receiver) {
+        return receiver->eventfd;
+}
+
+void receiver_get_stats(Receiver *receiver, ReceiverStats *stats) {
+        stats->n_events = __atomic_load_n(&receiver->n_events, __ATOMIC_RELAXED);
+        stats->n_overruns = __atomic_load_n(&receiver->n_overruns, __ATOMIC_RELAXED);
+        stats->n_dropped = __atomic_load_n(&receiver->n_dropped, __ATOMIC_RELAXED);
+        stats->high_water = __atomic_load_n(&receiver->high_water, __ATOMIC_RELAXED);
+        stats->capacity = RECEIVER_RING_SIZE;
+}
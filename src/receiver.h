@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "queue.h"
+#include "uevent.h"
+
+/*
+ * A thread that does nothing but drain the uevent socket, so that the kernel
+ * never waits on the daemon. Requests are handed over through a lock-free
+ * single producer, single consumer ring, and the consumer is woken through an
+ * eventfd.
+ */
+
+typedef struct Receiver Receiver;
+
+typedef struct ReceiverStats {
+        uint64_t n_events;
+        uint64_t n_overruns;
+        uint64_t n_dropped;
+        unsigned int high_water;
+        unsigned int capacity;
+} ReceiverStats;
+
+int receiver_new(Receiver **receiverp, UEventMonitor *monitor);
+void receiver_free(Receiver *receiver);
+
+int receiver_start(Receiver *receiver);
+int receiver_get_fd(Receiver *receiver);
+
+Request *receiver_pop(Receiver *receiver);
+void receiver_wake(Receiver *receiver);
+bool receiver_take_resync(Receiver *receiver);
+int receiver_get_error(Receiver *receiver);
+
+void receiver_get_stats(Receiver *receiver, ReceiverStats *stats);
+
+static inline void receiver_freep(Receiver **receiverp) {
+        if (*receiverp)
+                receiver_free(*receiverp);
+}
@@ -0,0 +1,275 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+
+#define SERVER_MAX_CONNECTIONS (8)
+#define SERVER_MAX_REQUEST (4096)
+#define SERVER_MAX_EVENTS (16)
+
+typedef struct ServerConnection {
+        int fd;
+        /* order of acceptance, the oldest connection is dropped first */
+        uint64_t serial;
+        char request[SERVER_MAX_REQUEST];
+        size_t request_size;
+        char *response;
+        size_t response_size;
+        size_t written;
+} ServerConnection;
+
+struct Server {
+        int fd;
+        int listenfd;
+        char *path;
+        const char *terminator;
+        ServerHandler handler;
+        void *userdata;
+        uint64_t n_accepted;
+        /* registered with data.u32 set to the index plus one, 0 is the listening socket */
+        ServerConnection connections[SERVER_MAX_CONNECTIONS];
+};
+
+static void server_close(ServerConnection *c) {
+        if (c->fd < 0)
+                return;
+
+        /* closing the fd removes it from the epoll set */
+        close(c->fd);
+        free(c->response);
+        c->fd = -1;
+        c->request_size = 0;
+        c->response = NULL;
+        c->response_size = 0;
+        c->written = 0;
+}
+
+int server_new(Server **serverp, const char *path, mode_t mode, const char *terminator,
+               ServerHandler handler, void *userdata) {
+        struct sockaddr_un address = {
+                .sun_family = AF_UNIX,
+        };
+        struct epoll_event ev = {
+                .events = EPOLLIN,
+                .data.u32 = 0,
+        };
+        Server *server;
+        struct stat st;
+        mode_t mask;
+        int r;
+
+        if (strlen(path) >= sizeof(address.sun_path))
+                return -ENAMETOOLONG;
+        strcpy(address.sun_path, path);
+
+        server = calloc(1, sizeof(*server));
+        if (!server)
+                return -ENOMEM;
+
+        server->fd = -1;
+        server->listenfd = -1;
+        server->terminator = terminator;
+        server->handler = handler;
+        server->userdata = userdata;
+        for (unsigned int i = 0; i < SERVER_MAX_CONNECTIONS; i ++)
+                server->connections[i].fd = -1;
+
+        server->listenfd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+        if (server->listenfd < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        /* a socket left behind by an earlier instance is replaced, anything else is not touched */
+        if (lstat(path, &st) >= 0 && S_ISSOCK(st.st_mode))
+                unlink(path);
+
+        /* the socket is created with the right permissions, there is no window to connect before a chmod() */
+        mask = umask(~mode & 0777);
+        r = bind(server->listenfd, (struct sockaddr*) &address, sizeof(address));
+        umask(mask);
+        if (r < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        server->path = strdup(path);
+        if (!server->path) {
+                unlink(path);
+                r = -ENOMEM;
+                goto fail;
+        }
+
+        if (listen(server->listenfd, SOMAXCONN) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        server->fd = epoll_create1(EPOLL_CLOEXEC);
+        if (server->fd < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        if (epoll_ctl(server->fd, EPOLL_CTL_ADD, server->listenfd, &ev) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        *serverp = server;
+
+        return 0;
+
+fail:
+        server_free(server);
+        return r;
+}
+
+void server_free(Server *server) {
+        for (unsigned int i = 0; i < SERVER_MAX_CONNECTIONS; i ++)
+                server_close(&server->connections[i]);
+        if (server->fd >= 0)
+                close(server->fd);
+        if (server->listenfd >= 0)
+                close(server->listenfd);
+        if (server->path) {
+                unlink(server->path);
+                free(server->path);
+        }
+        free(server);
+}
+
+int server_get_fd(Server *server) {
+        return server->fd;
+}
+
+static void server_accept(Server *server) {
+        for (;;) {
+                struct epoll_event ev = {
+                        .events = EPOLLIN,
+                };
+                ServerConnection *c = NULL;
+                int fd;
+
+                fd = accept4(server->listenfd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+                if (fd < 0)
+                        return;
+
+                for (unsigned int i = 0; i < SERVER_MAX_CONNECTIONS; i ++) {
+                        ServerConnection *candidate = &server->connections[i];
+
+                        if (candidate->fd < 0) {
+                                c = candidate;
+                                break;
+                        }
+
+                        if (!c || candidate->serial < c->serial)
+                                c = candidate;
+                }
+
+                server_close(c);
+
+                ev.data.u32 = c - server->connections + 1;
+                if (epoll_ctl(server->fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                        close(fd);
+                        continue;
+                }
+
+                c->fd = fd;
+                c->serial = server->n_accepted ++;
+        }
+}
+
+/* returns false once the connection is done with */
+static bool server_write(ServerConnection *c) {
+        while (c->written < c->response_size) {
+                ssize_t n;
+
+                n = send(c->fd, c->response + c->written, c->response_size - c->written, MSG_NOSIGNAL);
+                if (n < 0)
+                        return errno == EINTR || errno == EAGAIN;
+
+                c->written += n;
+        }
+
+        return false;
+}
+
+/* returns false once the connection is done with */
+static bool server_read(Server *server, ServerConnection *c) {
+        struct epoll_event ev = {
+                .events = EPOLLOUT,
+                .data.u32 = c - server->connections + 1,
+        };
+        size_t terminator_len = strlen(server->terminator);
+        char *end = NULL;
+
+        while (!end) {
+                size_t start;
+                ssize_t n;
+
+                if (c->request_size == sizeof(c->request))
+                        return false;
+
+                n = recv(c->fd, c->request + c->request_size, sizeof(c->request) - c->request_size, 0);
+                if (n < 0)
+                        return errno == EINTR || errno == EAGAIN;
+                else if (n == 0)
+                        return false;
+
+                /* the terminator may straddle two reads */
+                start = c->request_size > terminator_len ? c->request_size - terminator_len : 0;
+                c->request_size += n;
+                end = memmem(c->request + start, c->request_size - start, server->terminator, terminator_len);
+        }
+
+        if (server->handler(c->request, end + terminator_len - c->request, &c->response, &c->response_size,
+                            server->userdata) < 0)
+                return false;
+
+        if (!server_write(c))
+                return false;
+
+        return epoll_ctl(server->fd, EPOLL_CTL_MOD, c->fd, &ev) >= 0;
+}
+
+int server_process(Server *server) {
+        struct epoll_event events[SERVER_MAX_EVENTS];
+        int n;
+
+        n = epoll_wait(server->fd, events, SERVER_MAX_EVENTS, 0);
+        if (n < 0)
+                return errno == EINTR ? 0 : -errno;
+
+        for (int i = 0; i < n; i ++) {
+                ServerConnection *c;
+                bool open;
+
+                if (events[i].data.u32 == 0) {
+                        server_accept(server);
+                        continue;
+                }
+
+                c = &server->connections[events[i].data.u32 - 1];
+                if (c->fd < 0)
+                        continue;
+
+                if (c->response)
+                        open = server_write(c);
+                else
+                        open = server_read(server, c);
+
+                if (!open)
+                        server_close(c);
+        }
+
+        return 0;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * A Unix stream socket answering one request per connection. Everything is
+ * non-blocking and multiplexed on an epoll fd of its own, which the caller
+ * polls for input and then calls server_process(). A request is read until
+ * @terminator, handed to the handler, and the response it returns is written
+ * back before the connection is closed. When all connections are in use, the
+ * oldest is dropped for a new one, so idle clients cannot lock others out.
+ */
+
+typedef struct Server Server;
+
+/* returns a malloc()ed response in @responsep */
+typedef int (*ServerHandler)(const char *request, size_t size, char **responsep, size_t *sizep, void *userdata);
+
+int server_new(Server **serverp, const char *path, mode_t mode, const char *terminator,
+               ServerHandler handler, void *userdata);
+void server_free(Server *server);
+
+int server_get_fd(Server *server);
+int server_process(Server *server);
+
+static inline void server_freep(Server **serverp) {
+        if (*serverp)
+                server_free(*serverp);
+}
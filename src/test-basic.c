@@ -3,10 +3,742 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <ftw.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_XZ
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "cache.h"
+#include "firmware.h"
+#include "hashmap.h"
+#include "index.h"
+#include "queue.h"
+#include "uevent.h"
+
+#define FIRMWARE_SIZE (3 * 1024 * 1024 + 17)
+
+/* a fake sysfs firmware device: a directory with regular 'loading' and 'data' files */
+static int device_new(char *template) {
+        int devicefd, fd;
+
+        assert(mkdtemp(template));
+
+        devicefd = open(template, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        assert(devicefd >= 0);
+
+        fd = openat(devicefd, "loading", O_CREAT|O_WRONLY|O_CLOEXEC, 0600);
+        assert(fd >= 0);
+        close(fd);
+
+        fd = openat(devicefd, "data", O_CREAT|O_WRONLY|O_CLOEXEC, 0600);
+        assert(fd >= 0);
+        close(fd);
+
+        return devicefd;
+}
+
+static void device_free(const char *path, int devicefd) {
+        unlinkat(devicefd, "loading", 0);
+        unlinkat(devicefd, "data", 0);
+        close(devicefd);
+        rmdir(path);
+}
+
+static void read_file(int dirfd, const char *name, char *buf, size_t size, ssize_t *lenp) {
+        ssize_t len;
+        int fd;
+
+        fd = openat(dirfd, name, O_RDONLY|O_CLOEXEC);
+        assert(fd >= 0);
+
+        len = pread(fd, buf, size, 0);
+        assert(len >= 0);
+        close(fd);
+
+        *lenp = len;
+}
+
+static int firmware_new(const char *data, size_t size) {
+        char template[] = "/tmp/test-basic-firmware-XXXXXX";
+        size_t written = 0;
+        int fd;
+
+        fd = mkostemp(template, O_CLOEXEC);
+        assert(fd >= 0);
+        unlink(template);
+
+        while (written < size) {
+                ssize_t len = write(fd, data + written, size - written);
+                assert(len > 0);
+                written += len;
+        }
+
+        return fd;
+}
+
+static char *firmware_pattern(void) {
+        char *firmware;
+
+        firmware = malloc(FIRMWARE_SIZE);
+        assert(firmware);
+
+        for (size_t i = 0; i < FIRMWARE_SIZE; i ++)
+                firmware[i] = i * 7 + i / 4096;
+
+        return firmware;
+}
+
+static void check_loaded(int devicefd, const char *firmware) {
+        char loading[16];
+        char *data;
+        ssize_t len;
+
+        data = malloc(FIRMWARE_SIZE + 1);
+        assert(data);
+
+        read_file(devicefd, "data", data, FIRMWARE_SIZE + 1, &len);
+        assert(len == FIRMWARE_SIZE);
+        assert(memcmp(data, firmware, FIRMWARE_SIZE) == 0);
+
+        read_file(devicefd, "loading", loading, sizeof(loading) - 1, &len);
+        loading[len] = '\0';
+        assert(strcmp(loading, "1\n0\n") == 0);
+
+        free(data);
+}
+
+static void test_load(const char *backend) {
+        char template[] = "/tmp/test-basic-device-XXXXXX";
+        FirmwareStats stats = {};
+        char *firmware;
+        int devicefd, firmwarefd;
+
+        firmware = firmware_pattern();
+        devicefd = device_new(template);
+        firmwarefd = firmware_new(firmware, FIRMWARE_SIZE);
+
+        /* an odd chunk size forces many short, unaligned transfers */
+        firmware_set_chunk_size(65536 + 3);
+        if (strcmp(backend, "io_uring") == 0)
+                assert(firmware_set_io_uring(true) == 0);
+        else
+                assert(firmware_set_backend(backend) == 0);
+        assert(firmware_load(devicefd, firmwarefd, FIRMWARE_FORMAT_RAW, false, &stats) == 0);
+        firmware_set_io_uring(false);
+        firmware_set_backend(NULL);
+        firmware_set_chunk_size(0);
+
+        assert(stats.size == FIRMWARE_SIZE);
+        assert(stats.backend);
+        assert(stats.n_syscalls > 0);
+        /* io_uring may be unavailable at runtime, in which case we fall back */
+        if (strcmp(backend, "auto") != 0 && strcmp(backend, "io_uring") != 0)
+                assert(strcmp(stats.backend, backend) == 0);
+
+        check_loaded(devicefd, firmware);
+
+        close(firmwarefd);
+        device_free(template, devicefd);
+        free(firmware);
+}
+
+static void test_load_compressed(FirmwareFormat format) {
+        char template[] = "/tmp/test-basic-device-XXXXXX";
+        char templates[2][sizeof(template)];
+        FirmwareStats stats = {};
+        char *firmware, *compressed = NULL;
+        size_t compressed_size = 0;
+        int devicefd, firmwarefd, memfd, devicefds[2], results[2];
+
+        if (!firmware_format_supported(format))
+                return;
+
+        firmware = firmware_pattern();
+
+        switch (format) {
+#ifdef HAVE_XZ
+        case FIRMWARE_FORMAT_XZ:
+                compressed = malloc(lzma_stream_buffer_bound(FIRMWARE_SIZE));
+                assert(compressed);
+                assert(lzma_easy_buffer_encode(6, LZMA_CHECK_CRC32, NULL, (uint8_t*) firmware, FIRMWARE_SIZE,
+                                               (uint8_t*) compressed, &compressed_size,
+                                               lzma_stream_buffer_bound(FIRMWARE_SIZE)) == LZMA_OK);
+                break;
+#endif
+#ifdef HAVE_ZSTD
+        case FIRMWARE_FORMAT_ZSTD:
+                compressed = malloc(ZSTD_compressBound(FIRMWARE_SIZE));
+                assert(compressed);
+                compressed_size = ZSTD_compress(compressed, ZSTD_compressBound(FIRMWARE_SIZE),
+                                                firmware, FIRMWARE_SIZE, 3);
+                assert(!ZSTD_isError(compressed_size));
+                break;
+#endif
+        default:
+                assert(false);
+        }
+
+        devicefd = device_new(template);
+        firmwarefd = firmware_new(compressed, compressed_size);
+
+        assert(firmware_load(devicefd, firmwarefd, format, false, &stats) == 0);
+        assert(stats.size == FIRMWARE_SIZE);
+        check_loaded(devicefd, firmware);
+        device_free(template, devicefd);
+
+        /* decompressed once for several devices */
+        for (unsigned int i = 0; i < 2; i ++) {
+                strcpy(templates[i], "/tmp/test-basic-device-XXXXXX");
+                devicefds[i] = device_new(templates[i]);
+        }
+        assert(firmware_load_many(2, devicefds, firmwarefd, format, false, results, &stats) == 0);
+        assert(stats.size == FIRMWARE_SIZE);
+        for (unsigned int i = 0; i < 2; i ++) {
+                assert(results[i] == 0);
+                check_loaded(devicefds[i], firmware);
+                device_free(templates[i], devicefds[i]);
+        }
+
+        /* the same, through a sealed memfd holding the decompressed image */
+        assert(firmware_decompress_image(firmwarefd, format, FIRMWARE_SIZE - 1, &memfd, NULL) == -EFBIG);
+        assert(firmware_decompress_image(firmwarefd, format, FIRMWARE_SIZE, &memfd, &stats) == 0);
+        assert(stats.size == FIRMWARE_SIZE);
+        assert(fcntl(memfd, F_GET_SEALS) & F_SEAL_WRITE);
+        assert(write(memfd, "x", 1) < 0);
+
+        strcpy(template, "/tmp/test-basic-device-XXXXXX");
+        devicefd = device_new(template);
+        assert(firmware_load(devicefd, memfd, FIRMWARE_FORMAT_RAW, false, NULL) == 0);
+        check_loaded(devicefd, firmware);
+
+        close(memfd);
+        close(firmwarefd);
+        device_free(template, devicefd);
+        free(compressed);
+        free(firmware);
+}
+
+static void test_load_many(void) {
+        char templates[3][sizeof("/tmp/test-basic-device-XXXXXX")];
+        char gone[] = "/tmp/test-basic-device-XXXXXX";
+        FirmwareStats stats = {};
+        int devicefds[4], results[4];
+        char *firmware;
+        int firmwarefd;
+
+        firmware = firmware_pattern();
+        firmwarefd = firmware_new(firmware, FIRMWARE_SIZE);
+
+        for (unsigned int i = 0; i < 3; i ++) {
+                strcpy(templates[i], "/tmp/test-basic-device-XXXXXX");
+                devicefds[i] = device_new(templates[i]);
+        }
+
+        /* a device that went away is skipped without failing the others */
+        assert(mkdtemp(gone));
+        devicefds[3] = open(gone, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        assert(devicefds[3] >= 0);
+
+        firmware_set_chunk_size(65536 + 3);
+        assert(firmware_load_many(4, devicefds, firmwarefd, FIRMWARE_FORMAT_RAW, false, results, &stats) == 0);
+        firmware_set_chunk_size(0);
+
+        assert(stats.size == FIRMWARE_SIZE);
+        assert(strcmp(stats.backend, "mmap") == 0);
+        for (unsigned int i = 0; i < 3; i ++) {
+                assert(results[i] == 0);
+                check_loaded(devicefds[i], firmware);
+                device_free(templates[i], devicefds[i]);
+        }
+        assert(results[3] == 0);
+
+        close(devicefds[3]);
+        rmdir(gone);
+        close(firmwarefd);
+
+        /* an empty firmware is left to the caller */
+        firmwarefd = firmware_new("", 0);
+        assert(firmware_load_many(1, devicefds, firmwarefd, FIRMWARE_FORMAT_RAW, false, results, NULL) == -EIO);
+        close(firmwarefd);
+
+        free(firmware);
+}
+
+static void test_load_empty(void) {
+        char template[] = "/tmp/test-basic-device-XXXXXX";
+        char loading[16];
+        ssize_t len;
+        int devicefd, firmwarefd;
+
+        devicefd = device_new(template);
+        firmwarefd = firmware_new("", 0);
+
+        /* in tentative mode an unusable firmware is left for someone else */
+        assert(firmware_load(devicefd, firmwarefd, FIRMWARE_FORMAT_RAW, true, NULL) == 0);
+        read_file(devicefd, "loading", loading, sizeof(loading) - 1, &len);
+        assert(len == 0);
+
+        assert(firmware_load(devicefd, firmwarefd, FIRMWARE_FORMAT_RAW, false, NULL) == -EIO);
+        read_file(devicefd, "loading", loading, sizeof(loading) - 1, &len);
+        loading[len] = '\0';
+        assert(strcmp(loading, "-1\n") == 0);
+
+        close(firmwarefd);
+        device_free(template, devicefd);
+}
+
+static void test_open_first(bool io_uring) {
+        char template1[] = "/tmp/test-basic-dir-XXXXXX", template2[] = "/tmp/test-basic-dir-XXXXXX";
+        char *paths[] = { "missing.bin", "found.bin", "missing.bin", "found.bin" };
+        int dirfds[4];
+        unsigned int index, n_syscalls = 0;
+        int fd;
+
+        assert(mkdtemp(template1) && mkdtemp(template2));
+        dirfds[0] = dirfds[1] = open(template1, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        dirfds[2] = dirfds[3] = open(template2, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        assert(dirfds[0] >= 0 && dirfds[2] >= 0);
+
+        firmware_set_io_uring(io_uring);
+
+        assert(firmware_open_first(4, dirfds, paths, &index, &n_syscalls) == -ENOENT);
+
+        /* the first match in search order wins */
+        fd = openat(dirfds[2], "found.bin", O_CREAT|O_WRONLY|O_CLOEXEC, 0600);
+        assert(fd >= 0);
+        close(fd);
+        fd = firmware_open_first(4, dirfds, paths, &index, &n_syscalls);
+        assert(fd >= 0 && index == 3);
+        close(fd);
+
+        fd = openat(dirfds[0], "found.bin", O_CREAT|O_WRONLY|O_CLOEXEC, 0600);
+        assert(fd >= 0);
+        close(fd);
+        fd = firmware_open_first(4, dirfds, paths, &index, &n_syscalls);
+        assert(fd >= 0 && index == 1);
+        close(fd);
+
+        firmware_set_io_uring(false);
+
+        unlinkat(dirfds[0], "found.bin", 0);
+        unlinkat(dirfds[2], "found.bin", 0);
+        close(dirfds[0]);
+        close(dirfds[2]);
+        rmdir(template1);
+        rmdir(template2);
+}
+
+static void file_new(int dirfd, const char *path) {
+        int fd;
+
+        fd = openat(dirfd, path, O_CREAT|O_WRONLY|O_CLOEXEC, 0600);
+        assert(fd >= 0);
+        close(fd);
+}
+
+static void file_write(int dirfd, const char *path, size_t size) {
+        char buf[64] = {};
+        int fd;
+
+        assert(size <= sizeof(buf));
+
+        /* a new inode, as when a firmware file is replaced */
+        unlinkat(dirfd, path, 0);
+        fd = openat(dirfd, path, O_CREAT|O_WRONLY|O_CLOEXEC, 0600);
+        assert(fd >= 0);
+        assert(write(fd, buf, size) == (ssize_t) size);
+        close(fd);
+}
+
+static int tree_remove_one(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+        return remove(path);
+}
+
+static void tree_free(const char *path, int dirfd) {
+        close(dirfd);
+        assert(nftw(path, tree_remove_one, 16, FTW_DEPTH|FTW_PHYS) == 0);
+}
+
+static void test_hashmap(void) {
+        char keys[1000][16];
+        HashmapIterator i = HASHMAP_ITERATOR_FIRST;
+        Hashmap *hashmap;
+        const char *key;
+        unsigned int n = 0;
+        void *value;
+
+        assert(hashmap_new(&hashmap) == 0);
+
+        /* enough entries to grow the table several times */
+        for (unsigned int k = 0; k < 1000; k ++) {
+                snprintf(keys[k], sizeof(keys[k]), "key-%u", k);
+                assert(hashmap_put(hashmap, keys[k], keys[k]) == 0);
+        }
+        assert(hashmap_size(hashmap) == 1000);
+        assert(hashmap_put(hashmap, "key-7", NULL) == -EEXIST);
+
+        for (unsigned int k = 0; k < 1000; k ++)
+                assert(hashmap_get(hashmap, keys[k]) == keys[k]);
+        assert(!hashmap_get(hashmap, "key-1000"));
+
+        /* the current entry may be removed while iterating */
+        while (hashmap_iterate(hashmap, &i, &key, &value)) {
+                assert(key == value);
+                if (n ++ % 2 == 0)
+                        assert(hashmap_remove(hashmap, key) == value);
+        }
+        assert(n == 1000);
+        assert(hashmap_size(hashmap) == 500);
+        assert(!hashmap_remove(hashmap, "key-1000"));
+
+        n = 0;
+        for (unsigned int k = 0; k < 1000; k ++)
+                if (hashmap_get(hashmap, keys[k]))
+                        n ++;
+        assert(n == 500);
+
+        hashmap_free(hashmap);
+}
+
+static void cache_add_file(Cache *cache, int dirfd, const char *name, unsigned int dir, uint64_t generation) {
+        int fd;
+
+        fd = openat(dirfd, name, O_RDONLY|O_CLOEXEC);
+        assert(fd >= 0);
+        assert(cache_add(cache, name, dir, FIRMWARE_FORMAT_RAW, fd, -1, generation) == 0);
+        close(fd);
+}
+
+static bool cache_hit(Cache *cache, const int *dirfds, const char *name) {
+        FirmwareFormat format;
+        int fd;
+
+        fd = cache_lookup(cache, dirfds, name, &format);
+        if (fd < 0)
+                return false;
+
+        assert(format == FIRMWARE_FORMAT_RAW);
+        close(fd);
+
+        return true;
+}
+
+static void test_cache(void) {
+        char template[] = "/tmp/test-basic-dir-XXXXXX";
+        CacheStats stats;
+        uint64_t generation;
+        int dirfds[2];
+        Cache *cache;
+
+        assert(mkdtemp(template));
+        dirfds[0] = dirfds[1] = open(template, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        assert(dirfds[0] >= 0);
+
+        file_write(dirfds[0], "a.bin", 10);
+        file_write(dirfds[0], "b.bin", 10);
+        file_write(dirfds[0], "c.bin", 10);
+        file_write(dirfds[0], "large.bin", 40);
+
+        assert(cache_new(&cache, 25, 0) == 0);
+        assert(!cache_hit(cache, dirfds, "a.bin"));
+
+        cache_add_file(cache, dirfds[0], "a.bin", 0, cache_get_generation(cache));
+        assert(cache_hit(cache, dirfds, "a.bin"));
+
+        /* over budget, the least recently used entry goes */
+        cache_add_file(cache, dirfds[0], "b.bin", 0, cache_get_generation(cache));
+        assert(cache_hit(cache, dirfds, "a.bin"));
+        cache_add_file(cache, dirfds[0], "c.bin", 1, cache_get_generation(cache));
+        assert(!cache_hit(cache, dirfds, "b.bin"));
+        assert(cache_hit(cache, dirfds, "a.bin"));
+        assert(cache_hit(cache, dirfds, "c.bin"));
+
+        /* larger than the whole budget */
+        cache_add_file(cache, dirfds[0], "large.bin", 0, cache_get_generation(cache));
+        assert(!cache_hit(cache, dirfds, "large.bin"));
+
+        /* a replaced file is not served from the cache */
+        file_write(dirfds[0], "a.bin", 10);
+        assert(!cache_hit(cache, dirfds, "a.bin"));
+
+        /* entries of the given directory and those after it */
+        cache_remove_dirs(cache, 1);
+        assert(!cache_hit(cache, dirfds, "c.bin"));
+
+        /* nothing looked up before a removal is added after it */
+        generation = cache_get_generation(cache);
+        cache_remove(cache, "b.bin");
+        cache_add_file(cache, dirfds[0], "b.bin", 0, generation);
+        assert(!cache_hit(cache, dirfds, "b.bin"));
+
+        cache_add_file(cache, dirfds[0], "b.bin", 0, cache_get_generation(cache));
+        cache_remove(cache, "b.bin");
+        assert(!cache_hit(cache, dirfds, "b.bin"));
+
+        cache_get_stats(cache, &stats);
+        assert(stats.n_entries == 0 && stats.size == 0);
+        assert(stats.n_evictions == 1);
+        assert(stats.n_hits == 4);
+
+        cache_free(cache);
+        tree_free(template, dirfds[0]);
+}
+
+static void test_index(void) {
+        char template1[] = "/tmp/test-basic-dir-XXXXXX", template2[] = "/tmp/test-basic-dir-XXXXXX";
+        bool compressed = firmware_format_supported(FIRMWARE_FORMAT_ZSTD) &&
+                          firmware_format_supported(FIRMWARE_FORMAT_XZ);
+        FirmwareFormat format;
+        unsigned int dir;
+        int dirfds[3];
+        Index *index;
+
+        assert(mkdtemp(template1) && mkdtemp(template2));
+        dirfds[0] = open(template1, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        dirfds[2] = open(template2, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        assert(dirfds[0] >= 0 && dirfds[2] >= 0);
+        assert(mkdirat(dirfds[0], "release", 0700) == 0);
+        dirfds[1] = openat(dirfds[0], "release", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        assert(dirfds[1] >= 0);
+
+        /* an earlier directory wins over the format */
+        file_new(dirfds[0], "first.bin.xz");
+        file_new(dirfds[2], "first.bin");
+        /* within a directory, raw wins over .zst, which wins over .xz */
+        file_new(dirfds[0], "raw.bin");
+        file_new(dirfds[0], "raw.bin.zst");
+        file_new(dirfds[0], "raw.bin.xz");
+        file_new(dirfds[0], "zstd.bin.xz");
+        file_new(dirfds[0], "zstd.bin.zst");
+        /* the per-release subdirectory is a search directory of its own */
+        file_new(dirfds[1], "release.bin");
+        file_new(dirfds[2], "release.bin");
+        assert(mkdirat(dirfds[0], "sub", 0700) == 0);
+        file_new(dirfds[0], "sub/nested.bin");
+        /* names under a symlink to a directory are left to the full lookup */
+        assert(symlinkat("sub", dirfds[0], "link") == 0);
+        assert(mkdirat(dirfds[2], "link", 0700) == 0);
+        file_new(dirfds[2], "link/nested.bin");
+
+        assert(index_new(&index) == 0);
+        assert(index_add_dir(index, dirfds[0], 0, "", "release") == 0);
+        assert(index_add_dir(index, dirfds[2], 2, "", NULL) == 0);
+
+        assert(index_lookup(index, "release.bin", &dir, &format) == 0 && dir == 2);
+        assert(index_add_dir(index, dirfds[1], 1, "", NULL) == 0);
+        assert(index_lookup(index, "release.bin", &dir, &format) == 0 && dir == 1);
+
+        assert(index_lookup(index, "raw.bin", &dir, &format) == 0 && dir == 0 && format == FIRMWARE_FORMAT_RAW);
+        if (compressed) {
+                assert(index_lookup(index, "first.bin", &dir, &format) == 0);
+                assert(dir == 0 && format == FIRMWARE_FORMAT_XZ);
+                assert(index_lookup(index, "zstd.bin", &dir, &format) == 0);
+                assert(dir == 0 && format == FIRMWARE_FORMAT_ZSTD);
+        }
+        assert(index_lookup(index, "sub/nested.bin", &dir, &format) == 0 && dir == 0);
+        assert(index_lookup(index, "link/nested.bin", &dir, &format) == -ENOENT);
+        assert(index_lookup(index, "missing.bin", &dir, &format) == -ENOENT);
+
+        /* removing another format leaves the entry, removing the indexed copy forgets the name */
+        assert(index_update(index, 0, "raw.bin", FIRMWARE_FORMAT_XZ, false) == 0);
+        assert(index_lookup(index, "raw.bin", &dir, &format) == 0 && format == FIRMWARE_FORMAT_RAW);
+        assert(index_update(index, 0, "raw.bin", FIRMWARE_FORMAT_RAW, false) == 0);
+        assert(index_lookup(index, "raw.bin", &dir, &format) == -ENOENT);
+        assert(index_update(index, 2, "new.bin", FIRMWARE_FORMAT_RAW, true) == 0);
+        assert(index_lookup(index, "new.bin", &dir, &format) == 0 && dir == 2);
+
+        index_reset(index);
+        assert(index_lookup(index, "sub/nested.bin", &dir, &format) == -ENOENT);
+        index_free(index);
+
+        close(dirfds[1]);
+        tree_free(template1, dirfds[0]);
+        tree_free(template2, dirfds[2]);
+}
+
+static void test_request_order(QueuePolicy policy, const char *expected) {
+        /* the key of each policy, with ties among requests 'b', 'c' and 'e' */
+        static const struct {
+                const char *name;
+                uint64_t deadline_usec;
+                uint64_t size;
+                int priority;
+        } requests[] = {
+                { "a", 300, 30, 1 },
+                { "b", 200, 20, 2 },
+                { "c", 200, 20, 2 },
+                { "d", 100, 10, 3 },
+                { "e", 200, 20, 2 },
+                { "f", 400, 40, 0 },
+        };
+        Request *head = NULL, *tail = NULL, *request;
+        char order[sizeof(requests) / sizeof(requests[0]) + 1];
+        unsigned int n = 0;
+
+        for (unsigned int i = 0; i < sizeof(requests) / sizeof(requests[0]); i ++) {
+                assert(request_new(&request, "/devices/test", requests[i].name) == 0);
+                request->deadline_usec = requests[i].deadline_usec;
+                request->size = requests[i].size;
+                request->priority = requests[i].priority;
+                request_list_insert(policy, &head, &tail, request);
+        }
+
+        while ((request = head)) {
+                head = request->next;
+                if (!head)
+                        assert(request == tail);
+                order[n ++] = request->name[0];
+                request_free(request);
+        }
+        order[n] = '\0';
+
+        assert(strcmp(order, expected) == 0);
+}
+
+/* a uevent as the kernel sends it, NUL terminated one past its size */
+static size_t uevent_new(char *buf, size_t size, const char *action, const char *devpath, const char *subsystem) {
+        int r;
+
+        r = snprintf(buf, size, "%s@%s%cACTION=%s%cDEVPATH=%s%cSUBSYSTEM=%s%cFIRMWARE=test.bin%cSEQNUM=42",
+                     action, devpath, '\0', action, '\0', devpath, '\0', subsystem, '\0', '\0');
+        assert(r > 0 && (size_t) r + 1 < size);
+        buf[r + 1] = '\0';
+
+        return r + 1;
+}
+
+static void test_uevent_parse(void) {
+        static const char * const actions[] = { "add", "move", "remove", "change" };
+        char buf[4096], devpath[701];
+        UEvent event;
+        size_t size;
+
+        for (unsigned int i = 0; i < sizeof(actions) / sizeof(actions[0]); i ++) {
+                size = uevent_new(buf, sizeof(buf), actions[i], "/devices/test/firmware/test.bin", "firmware");
+                assert(uevent_parse(buf, size, &event) == 0);
+                assert(strcmp(event.action, actions[i]) == 0);
+                assert(strcmp(event.devpath, "/devices/test/firmware/test.bin") == 0);
+                assert(strcmp(event.subsystem, "firmware") == 0);
+                assert(strcmp(event.firmware, "test.bin") == 0);
+                assert(event.seqnum == 42);
+        }
+
+        /* events of other subsystems are parsed too, the caller skips them */
+        size = uevent_new(buf, sizeof(buf), "add", "/devices/test/block/sda", "block");
+        assert(uevent_parse(buf, size, &event) == 0);
+        assert(strcmp(event.subsystem, "block") == 0);
+
+        /* cut off before SUBSYSTEM= */
+        size = uevent_new(buf, sizeof(buf), "add", "/devices/test/firmware/test.bin", "firmware");
+        size = strlen(buf) + 1 + strlen("ACTION=add") + 1 + strlen("DEV");
+        buf[size] = '\0';
+        assert(uevent_parse(buf, size, &event) == -EBADMSG);
+
+        /* cut off within the header */
+        buf[10] = '\0';
+        assert(uevent_parse(buf, 10, &event) == -EBADMSG);
+
+        /* a devpath longer than the socket filter looks at */
+        memset(devpath, 'x', sizeof(devpath) - 1);
+        devpath[0] = '/';
+        devpath[sizeof(devpath) - 1] = '\0';
+        size = uevent_new(buf, sizeof(buf), "add", devpath, "firmware");
+        assert(uevent_parse(buf, size, &event) == 0);
+        assert(strcmp(event.devpath, devpath) == 0);
+        assert(strcmp(event.subsystem, "firmware") == 0);
+}
+
+static void test_uevent_filter(void) {
+        static const struct {
+                const char *action;
+                const char *subsystem;
+                size_t devpath_len;
+                bool passed;
+        } events[] = {
+                { "add",    "firmware", 32,  true },
+                { "move",   "firmware", 32,  true },
+                { "remove", "firmware", 32,  false },
+                { "change", "firmware", 32,  false },
+                { "add",    "block",    32,  false },
+                { "add",    "firmwar",  32,  false },
+                { "add",    "firmware", 500, true },
+                { "add",    "block",    500, false },
+                /* too long for the filter, left to uevent_parse() */
+                { "add",    "block",    700, true },
+        };
+        char buf[4096], devpath[701];
+        int fds[2];
+
+        assert(socketpair(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0, fds) == 0);
+        assert(uevent_attach_filter(fds[0]) == 0);
+
+        for (unsigned int i = 0; i < sizeof(events) / sizeof(events[0]); i ++) {
+                size_t size;
+                ssize_t len;
+
+                memset(devpath, 'x', events[i].devpath_len);
+                devpath[0] = '/';
+                devpath[events[i].devpath_len] = '\0';
+                size = uevent_new(buf, sizeof(buf), events[i].action, devpath, events[i].subsystem);
+                assert(send(fds[1], buf, size, 0) == (ssize_t) size);
+
+                len = recv(fds[0], buf, sizeof(buf), MSG_DONTWAIT);
+                if (events[i].passed)
+                        assert(len == (ssize_t) size);
+                else
+                        assert(len < 0 && errno == EAGAIN);
+        }
+
+        close(fds[0]);
+        close(fds[1]);
+}
 
 int main(int argc, char **argv) {
+        firmware_set_io_uring(false);
+
+        test_load("sendfile");
+        test_load("mmap");
+        test_load("pread");
+        test_load("auto");
+#ifdef HAVE_IO_URING
+        test_load("io_uring");
+#endif
+        test_load_compressed(FIRMWARE_FORMAT_XZ);
+        test_load_compressed(FIRMWARE_FORMAT_ZSTD);
+        test_load_empty();
+        test_load_many();
+
+        test_open_first(false);
+#ifdef HAVE_IO_URING
+        test_open_first(true);
+#endif
+
+        assert(firmware_set_backend("splice") == -EINVAL);
+
+        test_request_order(QUEUE_POLICY_FIFO, "abcdef");
+        test_request_order(QUEUE_POLICY_EDF, "dbceaf");
+        test_request_order(QUEUE_POLICY_SJF, "dbceaf");
+        test_request_order(QUEUE_POLICY_PRIORITY, "dbceaf");
+
+        test_hashmap();
+        test_cache();
+        test_index();
+
+        test_uevent_parse();
+        test_uevent_filter();
+
         return 0;
 }
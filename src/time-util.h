@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#define USEC_PER_SEC    ((uint64_t) 1000000ULL)
+#define USEC_PER_MSEC   ((uint64_t) 1000ULL)
+#define NSEC_PER_USEC   ((uint64_t) 1000ULL)
+
+static inline uint64_t now_usec(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t) ts.tv_sec * USEC_PER_SEC + (uint64_t) ts.tv_nsec / NSEC_PER_USEC;
+}
+
+/* CPU time consumed by the calling thread */
+static inline uint64_t thread_cpu_usec(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+        return (uint64_t) ts.tv_sec * USEC_PER_SEC + (uint64_t) ts.tv_nsec / NSEC_PER_USEC;
+}
@@ -0,0 +1,246 @@
+#include <errno.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "uevent.h"
+
+/* the kernel limits the environment of a uevent to 2048 bytes */
+#define UEVENT_BUFFER_SIZE (8192)
+/* the multicast group the kernel sends uevents to */
+#define UEVENT_GROUP_KERNEL (1)
+
+/*
+ * The filter looks for SUBSYSTEM=firmware right after the DEVPATH= entry,
+ * where the kernel puts it. It cannot loop, so it tests every possible end of
+ * the "action@devpath" header in turn, and passes events with a devpath longer
+ * than that on to be checked here.
+ */
+#define UEVENT_FILTER_MIN_HEADER (5)
+#define UEVENT_FILTER_MAX_HEADER (512)
+#define UEVENT_FILTER_COMMON (12)
+#define UEVENT_FILTER_SIZE (6 + 4 * (UEVENT_FILTER_MAX_HEADER - UEVENT_FILTER_MIN_HEADER) + 1 + UEVENT_FILTER_COMMON)
+
+struct UEventMonitor {
+        int fd;
+        char buf[UEVENT_BUFFER_SIZE];
+};
+
+int uevent_attach_filter(int fd) {
+        struct sock_filter *filter, *p;
+        struct sock_fprog fprog;
+        unsigned int common;
+        int r;
+
+        filter = calloc(UEVENT_FILTER_SIZE, sizeof(struct sock_filter));
+        if (!filter)
+                return -ENOMEM;
+
+        p = filter;
+
+        /* "add@" or "move@" */
+        *p++ = (struct sock_filter) BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 0);
+        *p++ = (struct sock_filter) BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x61646440, 4, 0);
+        *p++ = (struct sock_filter) BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x6d6f7665, 0, 2);
+        *p++ = (struct sock_filter) BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 4);
+        *p++ = (struct sock_filter) BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, '@', 1, 0);
+        *p++ = (struct sock_filter) BPF_STMT(BPF_RET|BPF_K, 0);
+
+        /*
+         * The header ends at offset k, the action is repeated in ACTION= and
+         * the devpath in DEVPATH=. Both for "add" and "move", that puts
+         * SUBSYSTEM= at offset 2k + 17.
+         */
+        common = UEVENT_FILTER_SIZE - UEVENT_FILTER_COMMON;
+        for (unsigned int k = UEVENT_FILTER_MIN_HEADER; k < UEVENT_FILTER_MAX_HEADER; k ++) {
+                unsigned int ja;
+
+                *p++ = (struct sock_filter) BPF_STMT(BPF_LD|BPF_B|BPF_ABS, k);
+                *p++ = (struct sock_filter) BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 0, 2);
+                *p++ = (struct sock_filter) BPF_STMT(BPF_LDX|BPF_W|BPF_IMM, 2 * k + 17);
+                ja = (unsigned int) (p - filter);
+                *p++ = (struct sock_filter) BPF_STMT(BPF_JMP|BPF_JA, common - ja - 1);
+        }
+
+        /* a header too long to test, check it in userspace */
+        *p++ = (struct sock_filter) BPF_STMT(BPF_RET|BPF_K, 0xffffffff);
+
+        /* "SUBSYSTEM=firmware\0" */
+        *p++ = (struct sock_filter) BPF_STMT(BPF_LD|BPF_W|BPF_IND, 0);
+        *p++ = (struct sock_filter) BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x53554253, 0, 9);
+        *p++ = (struct sock_filter) BPF_STMT(BPF_LD|BPF_W|BPF_IND, 4);
+        *p++ = (struct sock_filter) BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x59535445, 0, 7);
+        *p++ = (struct sock_filter) BPF_STMT(BPF_LD|BPF_W|BPF_IND, 8);
+        *p++ = (struct sock_filter) BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x4d3d6669, 0, 5);
+        *p++ = (struct sock_filter) BPF_STMT(BPF_LD|BPF_W|BPF_IND, 12);
+        *p++ = (struct sock_filter) BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x726d7761, 0, 3);
+        *p++ = (struct sock_filter) BPF_STMT(BPF_LD|BPF_W|BPF_IND, 15);
+        *p++ = (struct sock_filter) BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x61726500, 0, 1);
+        *p++ = (struct sock_filter) BPF_STMT(BPF_RET|BPF_K, 0xffffffff);
+        *p++ = (struct sock_filter) BPF_STMT(BPF_RET|BPF_K, 0);
+
+        fprog.len = (unsigned short) (p - filter);
+        fprog.filter = filter;
+
+        r = setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+        r = r < 0 ? -errno : 0;
+
+        free(filter);
+
+        return r;
+}
+
+/* a larger buffer than the default absorbs uevent storms, privileged callers may exceed rmem_max */
+int uevent_monitor_set_receive_buffer(UEventMonitor *monitor, int size) {
+        if (setsockopt(monitor->fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) >= 0)
+                return 0;
+
+        if (setsockopt(monitor->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+                return -errno;
+
+        return 0;
+}
+
+int uevent_monitor_new(UEventMonitor **monitorp) {
+        struct sockaddr_nl addr = {
+                .nl_family = AF_NETLINK,
+                .nl_groups = UEVENT_GROUP_KERNEL,
+        };
+        UEventMonitor *monitor;
+        int r;
+
+        monitor = malloc(sizeof(*monitor));
+        if (!monitor)
+                return -ENOMEM;
+
+        monitor->fd = socket(AF_NETLINK, SOCK_RAW|SOCK_CLOEXEC|SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+        if (monitor->fd < 0) {
+                free(monitor);
+                return -errno;
+        }
+
+        r = uevent_attach_filter(monitor->fd);
+        if (r < 0)
+                goto fail;
+
+        if (bind(monitor->fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        *monitorp = monitor;
+
+        return 0;
+
+fail:
+        close(monitor->fd);
+        free(monitor);
+        return r;
+}
+
+void uevent_monitor_free(UEventMonitor *monitor) {
+        close(monitor->fd);
+        free(monitor);
+}
+
+int uevent_monitor_get_fd(UEventMonitor *monitor) {
+        return monitor->fd;
+}
+
+static const char *uevent_match(const char *entry, const char *key, size_t key_len) {
+        if (strncmp(entry, key, key_len) != 0)
+                return NULL;
+
+        return entry + key_len;
+}
+
+/* parses the NUL separated message in @buf, which must be NUL terminated at @buf[size] */
+int uevent_parse(char *buf, size_t size, UEvent *event) {
+        const char *header_end;
+
+        *event = (UEvent) {};
+
+        /* "action@devpath", followed by the environment */
+        header_end = memchr(buf, '\0', size);
+        if (!header_end || !memchr(buf, '@', (size_t) (header_end - buf)))
+                return -EBADMSG;
+
+        for (const char *p = header_end + 1; p < buf + size; p += strlen(p) + 1) {
+                const char *value;
+
+                switch (p[0]) {
+                case 'A':
+                        if ((value = uevent_match(p, "ACTION=", 7)))
+                                event->action = value;
+                        break;
+                case 'D':
+                        if ((value = uevent_match(p, "DEVPATH=", 8)))
+                                event->devpath = value;
+                        break;
+                case 'F':
+                        if ((value = uevent_match(p, "FIRMWARE=", 9)))
+                                event->firmware = value;
+                        break;
+                case 'S':
+                        if ((value = uevent_match(p, "SUBSYSTEM=", 10)))
+                                event->subsystem = value;
+                        else if ((value = uevent_match(p, "SEQNUM=", 7)))
+                                event->seqnum = strtoull(value, NULL, 10);
+                        break;
+                }
+        }
+
+        if (!event->action || !event->devpath || !event->subsystem)
+                return -EBADMSG;
+
+        return 0;
+}
+
+/*
+ * Returns 1 if an event was received, 0 if there is none, and -ENOBUFS if
+ * events were lost because the socket overran. The socket stays usable.
+ */
+int uevent_monitor_receive(UEventMonitor *monitor, UEvent *event) {
+        for (;;) {
+                struct sockaddr_nl addr;
+                struct iovec iov = {
+                        .iov_base = monitor->buf,
+                        .iov_len = sizeof(monitor->buf) - 1,
+                };
+                struct msghdr msg = {
+                        .msg_name = &addr,
+                        .msg_namelen = sizeof(addr),
+                        .msg_iov = &iov,
+                        .msg_iovlen = 1,
+                };
+                ssize_t size;
+
+                size = recvmsg(monitor->fd, &msg, 0);
+                if (size < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN)
+                                return 0;
+
+                        return -errno;
+                }
+
+                /* only the kernel sends uevents, anything else is ignored */
+                if (msg.msg_namelen != sizeof(addr) || addr.nl_pid != 0)
+                        continue;
+
+                if (msg.msg_flags & MSG_TRUNC)
+                        continue;
+
+                monitor->buf[size] = '\0';
+
+                if (uevent_parse(monitor->buf, (size_t) size, event) < 0)
+                        continue;
+
+                return 1;
+        }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A receiver of kernel uevents, reading NETLINK_KOBJECT_UEVENT messages into
+ * a fixed buffer. A socket filter wakes the daemon only for firmware requests
+ * being added or moved. Events are parsed in place, their strings point into
+ * the buffer and stay valid until the next event is received.
+ */
+
+typedef struct UEvent {
+        const char *action;
+        const char *devpath;
+        const char *subsystem;
+        const char *firmware;
+        uint64_t seqnum;
+} UEvent;
+
+typedef struct UEventMonitor UEventMonitor;
+
+int uevent_monitor_new(UEventMonitor **monitorp);
+void uevent_monitor_free(UEventMonitor *monitor);
+
+int uevent_monitor_get_fd(UEventMonitor *monitor);
+int uevent_monitor_set_receive_buffer(UEventMonitor *monitor, int size);
+int uevent_monitor_receive(UEventMonitor *monitor, UEvent *event);
+
+int uevent_parse(char *buf, size_t size, UEvent *event);
+/* attaches the socket filter to @fd, only exported for tests */
+int uevent_attach_filter(int fd);
+
+static inline void uevent_monitor_freep(UEventMonitor **monitorp) {
+        if (*monitorp)
+                uevent_monitor_free(*monitorp);
+}
@@ -0,0 +1,296 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "watch.h"
+
+#define WATCH_MAX_DEPTH (16)
+#define WATCH_EVENTS (IN_CREATE|IN_MOVED_TO|IN_CLOSE_WRITE|IN_DELETE|IN_MOVED_FROM|IN_ONLYDIR|IN_EXCL_UNLINK)
+
+typedef struct WatchDir {
+        int dirfd;
+        unsigned int dir;
+        /* the per-release subdirectory, skipped at the top of a search directory */
+        char *skip;
+        char path[];
+} WatchDir;
+
+struct Watch {
+        int fd;
+        WatchCallback callback;
+        void *userdata;
+        /* indexed by watch descriptor */
+        WatchDir **dirs;
+        unsigned int n_dirs;
+};
+
+int watch_new(Watch **watchp, WatchCallback callback, void *userdata) {
+        Watch *watch;
+
+        watch = calloc(1, sizeof(*watch));
+        if (!watch)
+                return -ENOMEM;
+
+        watch->fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+        if (watch->fd < 0) {
+                free(watch);
+                return -errno;
+        }
+
+        watch->callback = callback;
+        watch->userdata = userdata;
+
+        *watchp = watch;
+
+        return 0;
+}
+
+static void watch_dir_free(WatchDir *d) {
+        if (!d)
+                return;
+
+        free(d->skip);
+        free(d);
+}
+
+void watch_free(Watch *watch) {
+        for (unsigned int i = 0; i < watch->n_dirs; i ++)
+                watch_dir_free(watch->dirs[i]);
+        free(watch->dirs);
+        close(watch->fd);
+        free(watch);
+}
+
+int watch_get_fd(Watch *watch) {
+        return watch->fd;
+}
+
+static int watch_add(Watch *watch, int dirfd, unsigned int dir, const char *path, const char *skip) {
+        char procpath[PATH_MAX];
+        WatchDir *d;
+        size_t len;
+        int wd, r;
+
+        /* inotify takes a path, reach the directory through its fd so the watch follows it */
+        r = snprintf(procpath, sizeof(procpath), "/proc/self/fd/%i%s%s", dirfd, path[0] ? "/" : "", path);
+        if (r < 0 || (size_t) r >= sizeof(procpath))
+                return -ENAMETOOLONG;
+
+        wd = inotify_add_watch(watch->fd, procpath, WATCH_EVENTS | (path[0] ? IN_DONT_FOLLOW : 0));
+        if (wd < 0)
+                return errno == ENOENT || errno == ENOTDIR || errno == EACCES ? 0 : -errno;
+
+        if ((unsigned int) wd >= watch->n_dirs) {
+                unsigned int n = (unsigned int) wd * 2 + 16;
+                WatchDir **dirs;
+
+                dirs = realloc(watch->dirs, n * sizeof(WatchDir*));
+                if (!dirs)
+                        return -ENOMEM;
+
+                memset(dirs + watch->n_dirs, 0, (n - watch->n_dirs) * sizeof(WatchDir*));
+                watch->dirs = dirs;
+                watch->n_dirs = n;
+        }
+
+        len = strlen(path) + 1;
+        d = calloc(1, sizeof(*d) + len);
+        if (!d)
+                return -ENOMEM;
+
+        d->dirfd = dirfd;
+        d->dir = dir;
+        memcpy(d->path, path, len);
+        if (skip) {
+                d->skip = strdup(skip);
+                if (!d->skip) {
+                        free(d);
+                        return -ENOMEM;
+                }
+        }
+
+        /* the same directory reached again replaces the earlier watch */
+        watch_dir_free(watch->dirs[wd]);
+        watch->dirs[wd] = d;
+
+        return 1;
+}
+
+static int watch_add_tree(Watch *watch, int dirfd, unsigned int dir, char *path, size_t path_len,
+                          const char *skip, unsigned int depth) {
+        struct dirent *de;
+        DIR *d;
+        int fd, r;
+
+        r = watch_add(watch, dirfd, dir, path, skip);
+        if (r <= 0 || depth >= WATCH_MAX_DEPTH)
+                return r;
+
+        fd = openat(dirfd, path_len > 0 ? path : ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (fd < 0)
+                return errno == ENOENT || errno == EACCES || errno == ENOTDIR ? 0 : -errno;
+
+        d = fdopendir(fd);
+        if (!d) {
+                close(fd);
+                return -errno;
+        }
+
+        while ((de = readdir(d))) {
+                size_t len;
+
+                if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN)
+                        continue;
+
+                if (de->d_name[0] == '.' &&
+                    (de->d_name[1] == '\0' || (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+                        continue;
+
+                if (depth == 0 && skip && strcmp(de->d_name, skip) == 0)
+                        continue;
+
+                len = strlen(de->d_name);
+                if (path_len + len + 2 > PATH_MAX)
+                        continue;
+
+                if (path_len > 0)
+                        path[path_len] = '/';
+                memcpy(path + path_len + (path_len > 0), de->d_name, len + 1);
+
+                /* entries of unknown type that are not directories are refused by IN_ONLYDIR */
+                r = watch_add_tree(watch, dirfd, dir, path, path_len + (path_len > 0) + len, NULL, depth + 1);
+
+                path[path_len] = '\0';
+                if (r < 0)
+                        break;
+        }
+
+        closedir(d);
+
+        return r;
+}
+
+int watch_add_dir(Watch *watch, int dirfd, unsigned int dir, const char *skip) {
+        char path[PATH_MAX] = "";
+        int r;
+
+        if (dirfd < 0)
+                return 0;
+
+        r = watch_add_tree(watch, dirfd, dir, path, 0, skip, 0);
+
+        return r < 0 ? r : 0;
+}
+
+void watch_remove_dir(Watch *watch, unsigned int dir) {
+        for (unsigned int i = 0; i < watch->n_dirs; i ++) {
+                if (!watch->dirs[i] || watch->dirs[i]->dir != dir)
+                        continue;
+
+                /* the pending IN_IGNORED finds no directory and is dropped */
+                inotify_rm_watch(watch->fd, (int) i);
+                watch_dir_free(watch->dirs[i]);
+                watch->dirs[i] = NULL;
+        }
+}
+
+/* reports events below search directory i as map[i] from now on, and stops watching it where that is negative */
+void watch_renumber_dirs(Watch *watch, const int *map, unsigned int n_dirs) {
+        for (unsigned int i = 0; i < watch->n_dirs; i ++) {
+                WatchDir *d = watch->dirs[i];
+
+                if (!d)
+                        continue;
+
+                if (d->dir < n_dirs && map[d->dir] >= 0) {
+                        d->dir = map[d->dir];
+                        continue;
+                }
+
+                inotify_rm_watch(watch->fd, (int) i);
+                watch_dir_free(d);
+                watch->dirs[i] = NULL;
+        }
+}
+
+static int watch_handle_event(Watch *watch, const struct inotify_event *event) {
+        char path[PATH_MAX];
+        unsigned int dir;
+        WatchDir *d;
+        size_t len;
+        int r;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+                watch->callback(0, NULL, IN_Q_OVERFLOW, watch->userdata);
+                return 0;
+        }
+
+        if (event->wd < 0 || (unsigned int) event->wd >= watch->n_dirs)
+                return 0;
+
+        d = watch->dirs[event->wd];
+        if (!d)
+                return 0;
+
+        if (event->mask & IN_IGNORED) {
+                watch_dir_free(d);
+                watch->dirs[event->wd] = NULL;
+                return 0;
+        }
+
+        if (event->len == 0 || (d->skip && strcmp(event->name, d->skip) == 0))
+                return 0;
+
+        r = snprintf(path, sizeof(path), "%s%s%s", d->path, d->path[0] ? "/" : "", event->name);
+        if (r < 0 || (size_t) r >= sizeof(path))
+                return 0;
+        len = (size_t) r;
+        dir = d->dir;
+
+        if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE|IN_MOVED_TO))) {
+                /* files may already have been created in it before the watch is in place */
+                r = watch_add_tree(watch, d->dirfd, dir, path, len, NULL, 1);
+                if (r < 0)
+                        return r;
+        }
+
+        watch->callback(dir, path, event->mask, watch->userdata);
+
+        return 0;
+}
+
+int watch_process(Watch *watch) {
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+        for (;;) {
+                ssize_t size;
+
+                size = read(watch->fd, buf, sizeof(buf));
+                if (size < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN)
+                                return 0;
+
+                        return -errno;
+                }
+
+                for (char *p = buf; p < buf + size; ) {
+                        const struct inotify_event *event = (const struct inotify_event*) p;
+                        int r;
+
+                        r = watch_handle_event(watch, event);
+                        if (r < 0)
+                                return r;
+
+                        p += sizeof(*event) + event->len;
+                }
+        }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Watches search directories and all directories below them with inotify.
+ * Directories created later are watched as they appear. The callback gets the
+ * search directory and the path of the affected entry relative to it, or a
+ * NULL path with IN_Q_OVERFLOW if events were lost.
+ */
+
+typedef struct Watch Watch;
+
+typedef void (*WatchCallback)(unsigned int dir, char *path, uint32_t mask, void *userdata);
+
+int watch_new(Watch **watchp, WatchCallback callback, void *userdata);
+void watch_free(Watch *watch);
+
+int watch_get_fd(Watch *watch);
+int watch_add_dir(Watch *watch, int dirfd, unsigned int dir, const char *skip);
+void watch_remove_dir(Watch *watch, unsigned int dir);
+void watch_renumber_dirs(Watch *watch, const int *map, unsigned int n_dirs);
+int watch_process(Watch *watch);
+
+static inline void watch_freep(Watch **watchp) {
+        if (*watchp)
+                watch_free(*watchp);
+}
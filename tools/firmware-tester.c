@@ -7,6 +7,10 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <fcntl.h>
 
 #include <glib.h>
@@ -57,6 +61,12 @@ static const struct config_data cfg_tentative = {
         .content =  "tentative",
 };
 
+static const struct config_data cfg_tentative_watch = {
+        .path =     LOAD_PATH_DAEMON,
+        .filename = "tentative-watch.bin",
+        .content =  "tentative watch",
+};
+
 
 /* -------------------------------------------------------------------- */
 /* helper functions */
@@ -349,10 +359,59 @@ static void teardown_daemon(void) {
         daemon_pid = -1;
 }
 
+/* an abstract socket the daemon sends READY=1 to, once coldplug is done */
+static int notify_socket_new(char *env, size_t size) {
+        struct sockaddr_un address = {
+                .sun_family = AF_UNIX,
+        };
+        struct timeval timeout = {
+                .tv_sec = 5,
+        };
+        socklen_t len;
+        int fd;
+
+        len = snprintf(address.sun_path + 1, sizeof(address.sun_path) - 1,
+                        "firmware-tester-%d", getpid());
+        snprintf(env, size, "NOTIFY_SOCKET=@%s", address.sun_path + 1);
+
+        fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+        if (fd < 0)
+                return -errno;
+
+        if (bind(fd, (struct sockaddr *) &address,
+                        offsetof(struct sockaddr_un, sun_path) + 1 + len) < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                        sizeof(timeout)) < 0) {
+                int err = -errno;
+
+                close(fd);
+                return err;
+        }
+
+        return fd;
+}
+
+static bool wait_daemon_ready(int fd) {
+        char buf[256];
+        ssize_t len;
+
+        for (;;) {
+                len = recv(fd, buf, sizeof(buf) - 1, 0);
+                if (len < 0)
+                        return false;
+                buf[len] = '\0';
+
+                if (!strcmp(buf, "READY=1") || !strncmp(buf, "READY=1\n", 8))
+                        return true;
+        }
+}
+
 static pid_t run_daemon(const char *path, bool tentative) {
+        _cleanup_(closep) int notify_fd = -1;
         const char *home;
         const char *daemon = NULL;
-        char *argv[5], *envp[1];
+        char *argv[5], *envp[2];
+        char notify_env[128];
         pid_t pid;
         int i, pos;
 
@@ -388,7 +447,15 @@ static pid_t run_daemon(const char *path, bool tentative) {
                 argv[pos++] = "--tentative";
         argv[pos] = NULL;
 
-        envp[0] = NULL;
+        notify_fd = notify_socket_new(notify_env, sizeof(notify_env));
+        if (notify_fd < 0) {
+                tester_warn("failed to create notification socket: %s",
+                        strerror(-notify_fd));
+                envp[0] = NULL;
+        } else {
+                envp[0] = notify_env;
+                envp[1] = NULL;
+        }
 
         if (tester_use_debug()) {
                 tester_debug("start firmwared");
@@ -402,6 +469,10 @@ static pid_t run_daemon(const char *path, bool tentative) {
 
         tester_print("firmware daemon process %d created", pid);
 
+        /* instead of racing with coldplug */
+        if (notify_fd >= 0 && !wait_daemon_ready(notify_fd))
+                tester_warn("firmware daemon did not report readiness");
+
         return pid;
 }
 
@@ -521,6 +592,21 @@ static void test_tentative_load(const void *test_data) {
                         test_tentative_trigger_cb, (gpointer)user);
 }
 
+static void test_tentative_file_appears(void *user_data) {
+        struct user_data *user = user_data;
+
+        tester_debug("create firmware file while the daemon keeps running");
+        setup_firmware_files(user->cfg);
+}
+
+static void test_tentative_watch_load(const void *test_data) {
+        struct user_data *user = tester_get_data();
+
+        tester_wait(2, test_tentative_file_appears, user);
+        trigger_load_async(user->fd, user->cfg->filename, NULL,
+                        test_tentative_trigger_cb, (gpointer)user);
+}
+
 static void setup_tentative_load(const void *test_data) {
         struct user_data *user = tester_get_data();
 
@@ -597,6 +683,9 @@ int main(int argc, char *argv[]) {
         test_load("Load via daemon tentative mode",
                 setup_tentative_load, test_tentative_load,
                 teardown_daemon_load, &cfg_tentative);
+        test_load("Load via daemon tentative mode when file appears",
+                setup_tentative_load, test_tentative_watch_load,
+                teardown_daemon_load, &cfg_tentative_watch);
         test_load("Load via kernel",
                 setup_kernel_sync_load, test_firmware_load,
                 teardown_kernel_load, &cfg_kernel);